@@ -0,0 +1,24 @@
+#include "../include/bench.h"
+#include "../include/spinlk.h"
+
+static spinlk_t lk = SPINLK_INITIALIZER;
+static volatile int count; // harts arrived in this round
+static volatile int round;
+
+void bench_barrier(void) {
+    spinlk_acquire(&lk);
+    int r = round;
+    if (++count == CPUS) {
+        count = 0;
+        round++;
+    }
+    spinlk_release(&lk);
+    while (round == r)
+        ;
+}
+
+uint32_t bench_rand(uint64_t *seed) {
+    // Knuth's MMIX LCG, the high bits are the random ones
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *seed >> 33;
+}
@@ -0,0 +1,48 @@
+#include "../include/bench.h"
+#include "../include/bio.h"
+#include "../include/hart.h"
+#include "../include/kprintf.h"
+
+/*
+    Buffer cache hit path scaling
+
+    Every hart reads its own PERHART blocks over and over,
+    all of which are cached, so bread/brelease never go to the
+    disk and the run measures bget/brelease and their locking.
+    Run with CPUS=1,2,4,8 and compare the total rate.
+*/
+
+#define PERHART 32  // blocks per hart, all cached
+#define ITERS 20000 // bread/brelease pairs per hart
+
+static uint64_t elapsed[CPUS];
+
+void bench_bio_hit(void) {
+    uint64_t hart = r_tp();
+    uint32_t first = hart * PERHART;
+
+    // bring every hart's blocks in
+    if (hart == 0)
+        for (int i = 0; i < CPUS * PERHART; i++)
+            bio.brelease(bio.bread(0, i));
+    bench_barrier();
+
+    uint64_t t0 = r_time();
+    for (int i = 0; i < ITERS; i++)
+        bio.brelease(bio.bread(0, first + i % PERHART));
+    elapsed[hart] = r_time() - t0;
+    bench_barrier();
+
+    if (hart)
+        return;
+    uint64_t max = 0;
+    for (int i = 0; i < CPUS; i++) {
+        kprintf("bio_hit: hart %d: %d hits in %d us\n",
+                i, ITERS, (int)TICKS_TO_US(elapsed[i]));
+        if (elapsed[i] > max)
+            max = elapsed[i];
+    }
+    kprintf("bio_hit: %d harts: %d hits/ms\n", CPUS,
+            (int)((uint64_t)CPUS * ITERS * 1000 / TICKS_TO_US(max)));
+    bio.stats();
+}
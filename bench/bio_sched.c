@@ -0,0 +1,59 @@
+#include "../include/bench.h"
+#include "../include/bio.h"
+#include "../include/iosched.h"
+#include "../include/disk.h"
+#include "../include/hart.h"
+#include "../include/kprintf.h"
+
+/*
+    I/O scheduler policies on scattered reads
+
+    Reads NREAD uncached blocks of a SPAN block region with
+    bio.bread_async, all at once and in a scrambled order, then
+    waits for them, under each scheduler policy with the disk
+    held to DEPTH requests so that the rest queue up. Each
+    policy gets a region of its own so that nothing is cached.
+    Prints the time each took, then iosched.stats for the merges
+    and dispatch latency of each. Runs on hart 0 only.
+*/
+
+#define NREAD 256
+#define SPAN 256   // blocks, NREAD of them are read
+#define STRIDE 97  // coprime to SPAN, so every block comes up once
+#define DEPTH 4
+
+static buf_t *bufs[NREAD];
+
+static struct {
+    char *name;
+    int policy;
+} policies[] = {
+    {"noop", IOSCHED_NOOP},
+    {"deadline", IOSCHED_DEADLINE},
+    {"elevator", IOSCHED_ELEVATOR},
+};
+
+void bench_bio_sched(void) {
+    if (r_tp())
+        return;
+
+    bio.setra(0);
+    iosched.setdepth(DEPTH);
+    for (int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        iosched.setpolicy(policies[p].policy);
+        uint32_t base = (p + 1) * SPAN;
+        uint64_t t0 = r_time();
+        for (int i = 0; i < NREAD; i++)
+            bufs[i] = bio.bread_async(0, base + i * STRIDE % SPAN, 0, 0);
+        for (int i = 0; i < NREAD; i++) {
+            bio.wait(bufs[i]);
+            bio.brelease(bufs[i]);
+        }
+        kprintf("bio_sched: %s: %d reads in %d us\n", policies[p].name, NREAD,
+                (int)TICKS_TO_US(r_time() - t0));
+    }
+    iosched.setpolicy(IOSCHED_POLICY);
+    iosched.setdepth(IOSCHED_DEPTH);
+    iosched.stats();
+    disk.stats();
+}
@@ -0,0 +1,98 @@
+#include "../include/bench.h"
+#include "../include/bio.h"
+#include "../include/disk.h"
+#include "../include/hart.h"
+#include "../include/kprintf.h"
+
+/*
+    Buffer cache replacement policy
+
+    Replays a few block access traces against a cache of NBUF
+    buffers and prints the hit ratio of each. The traces are
+    generated here, from a fixed seed, so every build replays
+    the same accesses; build once per policy and compare:
+
+        make run BENCH=bio_trace NBUF=64 BIOPOLICY=LRU
+        make run BENCH=bio_trace NBUF=64 BIOPOLICY=2Q
+
+    loop+scan   a hot set of HOT blocks read over and over, with a
+                SCAN block sequential scan of cold blocks after
+                every few passes
+    skewed      80% of the reads go to 20% of SPAN blocks
+    loop        a cyclic loop over 1.5 times the cache size
+
+    Read-ahead is turned off so only the policy decides what is
+    cached. Runs on hart 0 only.
+*/
+
+#ifndef NBUF
+#define NBUF 0
+#endif
+#define CACHE (NBUF ? NBUF : 64) // NBUF must be set, see below
+#define ACCESSES 20000 // per trace, after a warm-up of ACCESSES / 10
+#define HOT 32
+#define SCAN 256
+#define SPAN 512
+
+static uint64_t seed = 1;
+
+static uint32_t loopscan(int i) {
+    static uint32_t scan = HOT; // next cold block
+    // 4 passes over the hot set, then a scan
+    int round = 4 * HOT + SCAN;
+    if (i % round < 4 * HOT)
+        return i % HOT;
+    uint32_t b = scan++;
+    if (scan >= disk.nblocks())
+        scan = HOT;
+    return b;
+}
+
+static uint32_t skewed(int i) {
+    if (bench_rand(&seed) % 100 < 80)
+        return bench_rand(&seed) % (SPAN / 5);
+    return SPAN / 5 + bench_rand(&seed) % (SPAN - SPAN / 5);
+}
+
+static uint32_t loop(int i) {
+    return i % (CACHE * 3 / 2);
+}
+
+static struct {
+    char *name;
+    uint32_t (*next)(int i); // block of the i-th access
+} traces[] = {
+    {"loop+scan", loopscan},
+    {"skewed", skewed},
+    {"loop", loop},
+};
+
+void bench_bio_trace(void) {
+    if (r_tp())
+        return;
+    if (!NBUF) {
+        kprintf("bio_trace: needs a fixed cache size, make run BENCH=bio_trace NBUF=64\n");
+        return;
+    }
+
+    bio.setra(0);
+    uint64_t h0, m0, h1, m1;
+    kprintf("bio_trace: policy %s, %d buffers\n",
+            BIO_POLICY == BIO_2Q ? "2Q" : "LRU", CACHE);
+
+    for (int t = 0; t < sizeof(traces) / sizeof(traces[0]); t++) {
+        int i = 0;
+        for (; i < ACCESSES / 10; i++)
+            bio.brelease(bio.bread(0, traces[t].next(i) % disk.nblocks()));
+        bio.counters(&h0, &m0);
+        uint64_t t0 = r_time();
+        for (; i < ACCESSES / 10 + ACCESSES; i++)
+            bio.brelease(bio.bread(0, traces[t].next(i) % disk.nblocks()));
+        uint64_t us = TICKS_TO_US(r_time() - t0);
+        bio.counters(&h1, &m1);
+        kprintf("bio_trace: %s: %d hits, %d misses, %d%% hit, %d us\n",
+                traces[t].name, (int)(h1 - h0), (int)(m1 - m0),
+                (int)((h1 - h0) * 100 / (h1 - h0 + m1 - m0)), (int)us);
+    }
+    bio.stats();
+}
@@ -0,0 +1,72 @@
+#include "../include/bench.h"
+#include "../include/bio.h"
+#include "../include/disk.h"
+#include "../include/hart.h"
+#include "../include/pm.h"
+#include "../include/kprintf.h"
+
+/*
+    Driver CPU cost per disk request
+
+    Keeps QD random BSIZE reads in flight on hart 0 in polled
+    mode until NREQ are done, counting the cycles spent in
+    disk.submit and in disk.poll calls that retired something,
+    so the time the device itself takes is left out. Prints the
+    cycles per request of each. Run it once with PACKED=on and
+    once with PACKED=off to compare the packed and split rings.
+    The other harts are parked meanwhile.
+*/
+
+#define NREQ 20000
+#define QD 32
+
+static buf_t bufs[QD];
+
+void bench_disk_cycles(void) {
+    // idle, a hart polls the disk, and its reaps would go
+    // uncounted
+    if (r_tp()) {
+        bench_barrier();
+        return;
+    }
+
+    uint64_t seed = 1;
+    for (int i = 0; i < QD; i++)
+        bufs[i].data = (char *)pmmngr.alloc();
+    disk.setmode(DISK_POLL, 0);
+
+    uint64_t subcyc = 0, pollcyc = 0, polls = 0;
+    int issued = 0, done = 0;
+    while (done < NREQ) {
+        for (int i = 0; i < QD && issued < NREQ; i++) {
+            if (bufs[i].disk)
+                continue;
+            bufs[i].blockno = bench_rand(&seed) % disk.nblocks();
+            uint64_t t0 = r_cycle();
+            bool ok = disk.submit(&bufs[i], 0);
+            subcyc += r_cycle() - t0;
+            if (!ok)
+                break;
+            issued++;
+        }
+        uint64_t t0 = r_cycle();
+        disk.poll();
+        uint64_t t = r_cycle() - t0;
+        int left = 0;
+        for (int i = 0; i < QD; i++)
+            left += bufs[i].disk;
+        if (issued - left > done) {
+            pollcyc += t;
+            polls++;
+        }
+        done = issued - left;
+    }
+
+    kprintf("disk_cycles: %d requests at qd %d: submit %d cycles/req, reap %d cycles/req (%d polls)\n",
+            NREQ, QD, (int)(subcyc / NREQ), (int)(pollcyc / NREQ), (int)polls);
+    disk.setmode(DISK_INTR, 0);
+    disk.stats();
+    for (int i = 0; i < QD; i++)
+        pmmngr.free((pa_t)bufs[i].data);
+    bench_barrier();
+}
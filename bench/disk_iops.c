@@ -0,0 +1,72 @@
+#include "../include/bench.h"
+#include "../include/bio.h"
+#include "../include/disk.h"
+#include "../include/hart.h"
+#include "../include/pm.h"
+#include "../include/kprintf.h"
+
+/*
+    Disk IOPS at a fixed queue depth
+
+    Keeps QD random BSIZE reads in flight, straight through
+    disk.submit, for RUNTIME and prints the reads completed per
+    second for each QD in depths[]. Completions come in through
+    the disk interrupt, so this also measures the isr path. A QD
+    the queue can't hold (a request takes 3 descriptors, or 1 with
+    indirect descriptors) runs at the deepest the queue takes,
+    reported as "in flight".
+    Runs on hart 0 only.
+*/
+
+#define RUNTIME (TIMEBASE_HZ / 2) // per queue depth
+#define MAXQD 128
+
+static int depths[] = {1, 8, 32, 128};
+static buf_t bufs[MAXQD];
+static uint64_t seed = 1;
+
+void bench_disk_iops(void) {
+    if (r_tp())
+        return;
+
+    // data from whole pages, PGSIZE / BSIZE blocks each
+    for (int i = 0; i < MAXQD; i += PGSIZE / BSIZE) {
+        char *pg = (char *)pmmngr.alloc();
+        for (int j = 0; j < PGSIZE / BSIZE; j++)
+            bufs[i + j].data = pg + j * BSIZE;
+    }
+
+    for (int d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        int qd = depths[d];
+        uint64_t done = 0;
+        int inflight = 0, maxinflight = 0;
+        bool busy[MAXQD] = {0};
+
+        uint64_t t0 = r_time(), t;
+        while ((t = r_time()) - t0 < RUNTIME) {
+            for (int i = 0; i < qd; i++) {
+                buf_t *b = &bufs[i];
+                if (busy[i] && !b->disk) {
+                    busy[i] = 0;
+                    inflight--;
+                    done++;
+                }
+                if (!busy[i]) {
+                    b->blockno = bench_rand(&seed) % disk.nblocks();
+                    if (!disk.submit(b, 0))
+                        break; // queue full
+                    busy[i] = 1;
+                    if (++inflight > maxinflight)
+                        maxinflight = inflight;
+                }
+            }
+        }
+        // drain
+        for (int i = 0; i < qd; i++)
+            while (bufs[i].disk)
+                ;
+        kprintf("disk_iops: qd %d (%d in flight): %d reads/s\n",
+                qd, maxinflight, (int)(done * TIMEBASE_HZ / (t - t0)));
+        disk.stats();
+    }
+}
@@ -0,0 +1,71 @@
+#include "../include/bench.h"
+#include "../include/bio.h"
+#include "../include/disk.h"
+#include "../include/hart.h"
+#include "../include/pm.h"
+#include "../include/kprintf.h"
+
+/*
+    Disk read latency by completion mode
+
+    Issues NREAD random BSIZE reads one at a time through
+    disk.rw, timing each from submission to the waiter seeing it
+    done, under the interrupt, poll and hybrid completion modes,
+    and prints the median and 99th percentile of each in ns.
+    Runs on hart 0, with the other harts parked.
+*/
+
+#define NREAD 2000
+#define SPIN_US 50 // hybrid polling time
+
+static uint64_t lat[NREAD];
+static buf_t b;
+
+static struct {
+    char *name;
+    int mode;
+} modes[] = {
+    {"interrupt", DISK_INTR},
+    {"poll", DISK_POLL},
+    {"hybrid", DISK_HYBRID},
+};
+
+static void sort(uint64_t *a, int n) {
+    for (int i = 1; i < n; i++) {
+        uint64_t v = a[i];
+        int j = i - 1;
+        for (; j >= 0 && a[j] > v; j--)
+            a[j + 1] = a[j];
+        a[j + 1] = v;
+    }
+}
+
+void bench_disk_lat(void) {
+    // the other harts wait here rather than in the idle loop,
+    // whose disk.poll would reap hart 0's requests
+    if (r_tp()) {
+        bench_barrier();
+        return;
+    }
+
+    uint64_t seed = 1;
+    b.data = (char *)pmmngr.alloc();
+
+    for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        disk.setmode(modes[m].mode, SPIN_US);
+        for (int i = 0; i < NREAD; i++) {
+            b.blockno = bench_rand(&seed) % disk.nblocks();
+            uint64_t t0 = r_time();
+            disk.rw(&b, 0);
+            lat[i] = r_time() - t0;
+        }
+        sort(lat, NREAD);
+        kprintf("disk_lat: %s: p50 %d ns, p99 %d ns\n", modes[m].name,
+                (int)(lat[NREAD / 2] * 1000000000 / TIMEBASE_HZ),
+                (int)(lat[NREAD * 99 / 100] * 1000000000 / TIMEBASE_HZ));
+    }
+    disk.setmode(DISK_INTR, 0);
+    disk.stats();
+    pmmngr.free((pa_t)b.data);
+    bench_barrier();
+}
@@ -0,0 +1,71 @@
+#include "../include/bench.h"
+#include "../include/bio.h"
+#include "../include/disk.h"
+#include "../include/hart.h"
+#include "../include/pm.h"
+#include "../include/kprintf.h"
+
+/*
+    Disk I/O scaling with harts
+
+    Every hart keeps QD random BSIZE reads of its own in flight
+    through disk.submit, which puts them on the hart's own queue
+    when the device has one per hart, for RUNTIME. Hart 0 then
+    prints each hart's rate and the total. Run with CPUS=1,2,4,8
+    (the Makefile gives the device CPUS queues) and compare the
+    totals.
+*/
+
+#define RUNTIME (TIMEBASE_HZ / 2)
+#define QD 16 // reads in flight per hart
+
+static buf_t hartbufs[CPUS][QD]; // not on the 4K hart stack
+static uint64_t done[CPUS];
+static uint64_t elapsed[CPUS];
+
+void bench_disk_mq(void) {
+    uint64_t hart = r_tp();
+    buf_t *bufs = hartbufs[hart];
+    bool busy[QD] = {0};
+    uint64_t seed = hart + 1;
+
+    for (int i = 0; i < QD; i += PGSIZE / BSIZE) {
+        char *pg = (char *)pmmngr.alloc();
+        for (int j = 0; j < PGSIZE / BSIZE; j++)
+            bufs[i + j].data = pg + j * BSIZE;
+    }
+    bench_barrier();
+
+    uint64_t n = 0, t0 = r_time(), t;
+    while ((t = r_time()) - t0 < RUNTIME) {
+        for (int i = 0; i < QD; i++) {
+            if (busy[i] && !bufs[i].disk) {
+                busy[i] = 0;
+                n++;
+            }
+            if (!busy[i]) {
+                bufs[i].blockno = bench_rand(&seed) % disk.nblocks();
+                if (!disk.submit(&bufs[i], 0))
+                    break; // queue full
+                busy[i] = 1;
+            }
+        }
+    }
+    for (int i = 0; i < QD; i++)
+        while (bufs[i].disk)
+            ;
+    done[hart] = n;
+    elapsed[hart] = t - t0;
+    bench_barrier();
+
+    if (hart)
+        return;
+    uint64_t total = 0;
+    for (int i = 0; i < CPUS; i++) {
+        uint64_t rate = done[i] * TIMEBASE_HZ / elapsed[i];
+        kprintf("disk_mq: hart %d: %d reads/s\n", i, (int)rate);
+        total += rate;
+    }
+    kprintf("disk_mq: %d harts: %d reads/s\n", CPUS, (int)total);
+    disk.stats();
+}
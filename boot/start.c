@@ -24,6 +24,8 @@ void start() {
     // -ing that configuration against any future writes to pmp regs
     r_pmpaddr0(0x3FFFFFFFFFFFFF); // Highest physical address as TOP (top of range)
     w_pmpcfg0(1<<7|1<<3|1<<2|1<<1|1<<0); // Lock(7)|A(3-4)|X(2)|W(1)|R(0), A field set to 1, meaning pmpaddr0 holds TOP
+    // Let supervisor mode read the cycle (CY) and time (TM) counters
+    w_mcounteren(r_mcounteren()|1<<1|1<<0);
     // Delegate all traps in M-mode and S-mode to S-mode
     w_medeleg(0xFFFF);
     w_mideleg(0xFFFF);
@@ -2,84 +2,970 @@
 #include "../include/spinlk.h"
 #include "../include/kpanic.h"
 #include "../include/disk.h"
+#include "../include/iosched.h"
+#include "../include/pm.h"
+#include "../include/slab.h"
+#include "../include/kprintf.h"
+#include "../include/hart.h"
+#include "../include/timer.h"
+#include "../include/util.h"
 
-static buf_t bufs[30];
-static buf_t *mru;
-static buf_t *lru;
-static spinlk_t lk = SPINLK_INITIALIZER;
+/*
+    Every buffer holding a block is on the hash chain of
+    bucket HASH(dev, blockno), so bget finds a cached block
+    by walking one short chain.
+
+    The cache is split into NSHARD shards, each with its own
+    lock. Bucket i belongs to shard i % NSHARD, and a shard's
+    lock guards its buckets, its free list and the refct of
+    the buffers on them, so harts working on different blocks
+    rarely take the same lock.
+
+    Buffers nobody holds (refct == 0) are also on the free
+    list of their shard, most recently released first. These
+    are the only ones that can be reused for another block,
+    and the least recently released one (lru) is the one to
+    go. A shard whose free list is empty steals the lru of
+    another shard.
+
+    With BIO_POLICY == BIO_2Q (the default) a shard keeps two
+    free lists, after Johnson and Shasha's 2Q. A block read in
+    is cold and goes on the A1in list when released; a cold
+    buffer evicted leaves its block number in the shard's A1out
+    ghost ring. A block found there when read in again is hot,
+    and hot buffers go on the Am list (mru/lru). Cold buffers
+    are evicted first while they are more than a quarter of the
+    free ones, so a long scan of blocks read once only cycles
+    through A1in and leaves the hot blocks in Am alone. A1in is
+    in release order, which for blocks used once is load order.
+    With BIO_LRU every buffer is hot and Am is a plain LRU list.
+
+    Buffer headers and their data come from two slab caches.
+    The cache starts with NBUF buffers, or one per 128K of RAM
+    if NBUF is 0 (make NBUF=n), and may be grown or shrunk
+    later. When every buffer is in use bget grows the cache,
+    up to MAXBUF_MUL times its boot size, and after that waits
+    for a buffer to be released.
+
+    Read-ahead: bread tracks, per device, the block a sequential
+    reader would ask for next. While reads keep coming in order,
+    the window of blocks read ahead doubles, up to ramax (RA_MAX
+    by default, see bio.setra); when the order breaks, it halves.
+    Blocks in the window are read asynchronously into free
+    buffers with the ra flag set. These stay unreferenced on the
+    free lists, but are not reused while the disk owns them. A
+    later bread of such a block counts as a used prefetch; reusing
+    the buffer before that counts as a wasted one.
+
+    Write-back: with WRITEBACK set, bwrite only marks a buffer
+    dirty and puts it at the tail of the dirty list, oldest
+    first. Dirty buffers are not reused until written. Idle harts
+    (bio.flush_idle) write back a batch once the oldest has been
+    dirty for DIRTY_AGE or more than DIRTY_HIGH buffers are dirty,
+    and bwrite itself writes a batch when DIRTY_MAX are. A batch
+    is sorted by block before it goes to the disk. bio.sync(dev)
+    writes everything dirty on dev.
+
+    Asynchronous I/O: bread_async and write_async submit and
+    return; the disk interrupt calls b->done when the transfer
+    completes. A caller can so keep many transfers in flight and
+    wait on any of them with bio.wait(b).
+
+    Vectored I/O: bread_range queues each run of uncached blocks
+    at once (iosched.submitv), and the I/O scheduler makes one
+    disk request of it, split only where the device's
+    seg_max/size_max require. The write-back flusher queues its
+    sorted batch the same way. Every transfer goes through the
+    scheduler, which may also hold it back while the disk is
+    busy, reorder it and merge it with others (iosched.c).
+
+    Discards and zeroing move no data: bio.discard and
+    bio.zero_range first bring cached copies of the blocks in line
+    with the disk (transfers waited for, dirty ones no longer
+    written back, data zeroed), then send DISK_DISCARD or
+    DISK_ZERO requests straight to the disk. Without DISK_ZERO,
+    zero_range writes zero-filled blocks the old way.
+
+    Durability: with FLUSH negotiated the disk has a write cache,
+    and a write it completed may still only be in it. bio.flush
+    sends DISK_FLUSH and returns once the cache is on the medium;
+    it writes nothing back itself, so bio.sync and then bio.flush
+    make everything written to dev durable.
+*/
+
+#ifndef NBUF
+#define NBUF 0
+#endif
+#ifndef NSHARD
+#define NSHARD 8 // a power of two
+#endif
+#ifndef RA_MAX
+#define RA_MAX 32 // blocks
+#endif
+#define RA_MIN 4   // window when a sequential run is first seen
+#define NDEV 4     // devices with read-ahead state
+#define NGHOST 64 // A1out entries per shard
+#ifndef WRITEBACK
+#define WRITEBACK 1 // 0: bwrite writes through
+#endif
+#define DIRTY_AGE TIMEBASE_HZ // 1s
+#define DIRTY_HIGH (nbuf / 8)
+#define DIRTY_MAX (nbuf / 2)
+#define FLUSH_BATCH 32
+#define MINBUF 16
+#define MAXBUF_MUL 4
+#define GROWBY 16 // buffers added at a time when bget runs out
+
+typedef struct shard {
+    spinlk_t lk;
+    buf_t *mru; // free list head (Am under 2Q)
+    buf_t *lru; // free list tail
+    volatile int nfree; // buffers on the free lists
+    int nbuf;   // buffers whose block hashes to this shard, or free here
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t steals; // misses served from another shard's free list
+#if BIO_POLICY == BIO_2Q
+    buf_t *inmru; // A1in free list head
+    buf_t *inlru;
+    int nin;      // buffers on A1in
+    struct {
+        uint32_t dev;
+        uint32_t blockno; // ~0 if unused
+    } ghost[NGHOST];      // A1out, a ring
+    int ghead;            // next ghost slot to fill
+    uint64_t ghits;       // misses on a block in A1out
+#endif
+} __attribute__((aligned(64))) shard_t; // one cache line apart so harts don't false share
+
+static kmem_cache_t *bufcache;  // buf_t
+static kmem_cache_t *datacache; // BSIZE data blocks
+static buf_t **htbl;
+static uint64_t nhash; // a power of two, at least NSHARD
+static shard_t shards[NSHARD];
+
+// guards the cache size
+static spinlk_t sizelk = SPINLK_INITIALIZER;
+static int nbuf;       // buffers in the cache
+static int maxbuf;     // bget does not grow the cache beyond this
+
+static struct {
+    spinlk_t lk;
+    uint32_t next; // block a sequential reader reads next
+    uint32_t end;  // blocks before this have been read ahead
+    int window;    // blocks to read ahead of the reader
+} ras[NDEV];
+static int ramax = RA_MAX;
+static uint64_t ra_issued, ra_used, ra_wasted; // racy, only statistics
+
+// dirty buffers, least recently dirtied first
+static struct {
+    spinlk_t lk;
+    buf_t *head;
+    buf_t *tail;
+    volatile int n;
+    // taken off the list by a flush and not yet on disk, by
+    // device (WBSLOT)
+    volatile int claimed[NDEV + 1];
+} dirty = {SPINLK_INITIALIZER};
+#define WBSLOT(dev) ((dev) < NDEV ? (dev) : NDEV) // the last for any other device
+static uint64_t wb_flushes, wb_written; // racy, only statistics
+
+#define HASH(dev, blockno) (((dev) * 31 + (blockno)) & (nhash - 1))
+#define SHARD(dev, blockno) (&shards[HASH(dev, blockno) % NSHARD])
 
 static void init();
 static buf_t* bget(uint32_t, uint32_t);
 static buf_t* bread(uint32_t, uint32_t);
+static void bread_range(uint32_t, uint32_t, int, buf_t **);
 static void bwrite(buf_t*);
 static void brelease(buf_t*);
+static int grow(int);
+static int shrink(int);
+static void stats();
+static void counters(uint64_t *, uint64_t *);
+static void setra(int);
+static void sync(uint32_t);
+static void flush_idle();
+static buf_t* bread_async(uint32_t, uint32_t, biodone_t, void *);
+static void write_async(buf_t*, biodone_t, void *);
+static void bwait(buf_t*);
+static void discard(uint32_t, uint32_t, uint32_t);
+static void zero_range(uint32_t, uint32_t, uint32_t);
+static void bflush(uint32_t);
 
-bio_t bio = {init, bread, bwrite, brelease};
+bio_t bio = {init, bread, bread_range, bwrite, brelease, bread_async, write_async, bwait,
+             grow, shrink, stats, counters, setra, sync, flush_idle, discard, zero_range,
+             bflush};
+
+// Put b on the most recently used end of its free list in s
+static void putfree(shard_t *s, buf_t *b) {
+    buf_t **mru = &s->mru, **lru = &s->lru;
+#if BIO_POLICY == BIO_2Q
+    if (!b->hot) {
+        mru = &s->inmru;
+        lru = &s->inlru;
+        s->nin++;
+    }
+#endif
+    b->next = *mru;
+    b->prev = 0;
+    if (*mru)
+        (*mru)->prev = b;
+    else
+        *lru = b;
+    *mru = b;
+    s->nfree++;
+}
+
+// Put b, whose data is of no more use, on the least recently
+// used end of its free list in s, A1in under 2Q, so that it is
+// the first reused
+static void putstale(shard_t *s, buf_t *b) {
+    buf_t **mru = &s->mru, **lru = &s->lru;
+#if BIO_POLICY == BIO_2Q
+    b->hot = 0;
+    mru = &s->inmru;
+    lru = &s->inlru;
+    s->nin++;
+#endif
+    b->prev = *lru;
+    b->next = 0;
+    if (*lru)
+        (*lru)->next = b;
+    else
+        *mru = b;
+    *lru = b;
+    s->nfree++;
+}
+
+// Take b off its free list in s
+static void unfree(shard_t *s, buf_t *b) {
+    buf_t **mru = &s->mru, **lru = &s->lru;
+#if BIO_POLICY == BIO_2Q
+    if (!b->hot) {
+        mru = &s->inmru;
+        lru = &s->inlru;
+        s->nin--;
+    }
+#endif
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        *mru = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        *lru = b->prev;
+    b->prev = b->next = 0;
+    s->nfree--;
+}
+
+#if BIO_POLICY == BIO_2Q
+// Remember that b's block was evicted from A1in
+static void ghost(shard_t *s, buf_t *b) {
+    s->ghost[s->ghead].dev = b->dev;
+    s->ghost[s->ghead].blockno = b->blockno;
+    s->ghead = (s->ghead + 1) % NGHOST;
+}
+
+// Is the block in A1out? It is forgotten if so, as it is
+// about to be cached again
+static bool unghost(shard_t *s, uint32_t dev, uint32_t blockno) {
+    for (int i = 0; i < NGHOST; i++)
+        if (s->ghost[i].blockno == blockno && s->ghost[i].dev == dev) {
+            s->ghost[i].blockno = ~0;
+            return 1;
+        }
+    return 0;
+}
+#endif
+
+static void hash(buf_t *b) {
+    buf_t **head = &htbl[HASH(b->dev, b->blockno)];
+    b->hnext = *head;
+    if (b->hnext)
+        b->hnext->hpprev = &b->hnext;
+    b->hpprev = head;
+    *head = b;
+}
+
+// Take b off its hash chain, if it is on one
+static void unhash(buf_t *b) {
+    if (!b->hpprev)
+        return;
+    *b->hpprev = b->hnext;
+    if (b->hnext)
+        b->hnext->hpprev = b->hpprev;
+    b->hnext = 0;
+    b->hpprev = 0;
+}
+
+// Allocate n new buffers, spread over the shards
+// Caller must hold sizelk
+static int grow_locked(int n) {
+    static int next; // shard to put the next new buffer in
+    int i;
+    for (i = 0; i < n; i++) {
+        buf_t *b = kmem_cache_alloc(bufcache);
+        if (!b)
+            break;
+        if (!(b->data = kmem_cache_alloc(datacache))) {
+            kmem_cache_free(bufcache, b);
+            break;
+        }
+        b->valid = 0;
+        b->disk = 0;
+        b->ra = 0;
+        b->dirty = 0;
+        b->hot = BIO_POLICY == BIO_LRU;
+        b->done = 0;
+        b->dev = 0;
+        b->blockno = 0;
+        b->refct = 0;
+        b->hnext = 0;
+        b->hpprev = 0;
+        shard_t *s = &shards[next++ % NSHARD];
+        spinlk_acquire(&s->lk);
+        putfree(s, b);
+        s->nbuf++;
+        spinlk_release(&s->lk);
+        nbuf++;
+    }
+    return i;
+}
 
 void init () {
-    for (int i = 0; i < 30; i++) {
-        bufs[i].prev = (i == 0) ? 0 : &bufs[i-1];
-        bufs[i].next = (i == 29) ? 0 : &bufs[i+1];
+    int n = NBUF;
+    if (!n)
+        n = pmmngr.npages() * PGSIZE / (128 * 1024);
+    if (n < MINBUF)
+        n = MINBUF;
+    maxbuf = n * MAXBUF_MUL;
+
+    bufcache = kmem_cache_create("buf", sizeof(buf_t), 64);
+    datacache = kmem_cache_create("bdata", BSIZE, BSIZE);
+
+    // about one bucket per buffer the cache can grow to
+    int order = 0;
+    for (nhash = PGSIZE / sizeof(buf_t *); nhash < maxbuf && order < MAXORDER; nhash <<= 1)
+        order++;
+    htbl = (buf_t **)pmmngr.alloc_pages(order);
+    if (!bufcache || !datacache || !htbl)
+        kpanic("bio: no memory for the buffer cache\n");
+    for (int i = 0; i < nhash; i++)
+        htbl[i] = 0;
+#if BIO_POLICY == BIO_2Q
+    for (int i = 0; i < NSHARD; i++)
+        for (int j = 0; j < NGHOST; j++)
+            shards[i].ghost[j].blockno = ~0;
+#endif
+    // so that a first read of block 0 does not count as sequential
+    for (int i = 0; i < NDEV; i++)
+        ras[i].next = ~0;
+
+    spinlk_acquire(&sizelk);
+    grow_locked(n);
+    spinlk_release(&sizelk);
+    kprintf("bio: %d buffers in %d shards\n", nbuf, NSHARD);
+}
+
+// The least recently used buffer on a free list from lru that
+// the disk does not own (an in-flight read-ahead) and that holds
+// no unwritten data, 0 if there is none
+static buf_t *evictable(buf_t *lru) {
+    buf_t *b = lru;
+    while (b && (b->disk || b->dirty))
+        b = b->prev;
+    return b;
+}
+
+// The free buffer of s to reuse for another block, 0 if there
+// is none. The caller is about to take it.
+static buf_t *victim(shard_t *s) {
+    buf_t *b;
+#if BIO_POLICY == BIO_2Q
+    // A1in first while it is over its share, then Am, and
+    // either one if the other has nothing to give
+    bool in = s->nin * 4 > s->nfree;
+    if (!(b = evictable(in ? s->inlru : s->lru)))
+        b = evictable(in ? s->lru : s->inlru);
+    if (b && !b->hot && b->valid)
+        ghost(s, b);
+#else
+    b = evictable(s->lru);
+#endif
+    if (b && b->ra) {
+        b->ra = 0;
+        ra_wasted++;
     }
-    mru = &bufs[0];
-    lru = &bufs[29];
+    return b;
 }
 
-buf_t* bget(uint32_t dev, uint32_t blockno) {
-    spinlk_acquire(&lk);
+// Take the least recently used free buffer of any shard other
+// than s, 0 if there is none. The buffer is unhashed and off
+// every list; the caller must not hold any shard lock.
+static buf_t *steal(shard_t *s) {
+    for (int i = 1; i <= NSHARD; i++) {
+        shard_t *o = &shards[(s - shards + i) % NSHARD];
+        if (!o->nfree) // racy peek, rechecked under the lock
+            continue;
+        spinlk_acquire(&o->lk);
+        buf_t *b = victim(o);
+        if (b) {
+            unfree(o, b);
+            unhash(b);
+            o->nbuf--;
+        }
+        spinlk_release(&o->lk);
+        if (b)
+            return b;
+    }
+    return 0;
+}
+
+static bool anyfree() {
+    for (int i = 0; i < NSHARD; i++)
+        if (shards[i].nfree)
+            return 1;
+    return 0;
+}
+
+static int flush(bool all, uint32_t dev, int max);
 
+// Return a referenced buffer for the block, cached or not.
+// If every buffer is in use, wait for one unless try is set,
+// in which case return 0.
+static buf_t* bget_(uint32_t dev, uint32_t blockno, bool try) {
+    shard_t *s = SHARD(dev, blockno);
     buf_t *p = 0;
+    buf_t *stolen = 0;
 
-    for (p = mru; p; p = p->next)
-        if (p->dev == dev && p->blockno == blockno) {
-            p->refct++;
-            spinlk_release(&lk);
-            return p;
+    for (;;) {
+        spinlk_acquire(&s->lk);
+
+        // a stolen buffer now belongs to this shard
+        // whether or not it ends up being used
+        if (stolen) {
+            s->nbuf++;
+            putfree(s, stolen);
+            stolen = 0;
         }
-    
-    for (p = lru; p; p = p->prev)
-        if (!p->refct) {
+
+        for (p = htbl[HASH(dev, blockno)]; p; p = p->hnext)
+            if (p->dev == dev && p->blockno == blockno) {
+                if (!p->refct++)
+                    unfree(s, p);
+                s->hits++;
+                spinlk_release(&s->lk);
+                return p;
+            }
+
+        if ((p = victim(s))) {
+            unfree(s, p);
+            unhash(p);
             p->dev = dev;
             p->blockno = blockno;
             p->valid = 0;
             p->refct = 1;
-            spinlk_release(&lk);
+#if BIO_POLICY == BIO_2Q
+            if ((p->hot = unghost(s, dev, blockno)))
+                s->ghits++;
+#endif
+            hash(p);
+            s->misses++;
+            spinlk_release(&s->lk);
             return p;
         }
-    
-    kpanic("bget: no buffers\n");
-    return 0;
+        spinlk_release(&s->lk);
+
+        // this shard has no free buffer, take one from
+        // another shard or grow the cache, then start over
+        // as the block may have been brought in meanwhile
+        if ((stolen = steal(s))) {
+            s->steals++; // racy, only a statistic
+            continue;
+        }
+        if (try)
+            return 0;
+
+        // free buffers that are only dirty can be
+        // made usable by writing them back; if they are all
+        // being written already, reap what is done
+        if (dirty.n && anyfree()) {
+            if (!flush(1, 0, FLUSH_BATCH))
+                disk.poll();
+            continue;
+        }
+
+        spinlk_acquire(&sizelk);
+        if (!anyfree() && nbuf < maxbuf)
+            grow_locked(nbuf + GROWBY > maxbuf ? maxbuf - nbuf : GROWBY);
+        spinlk_release(&sizelk);
+
+        // every buffer is referenced, or free but with a
+        // transfer in flight: wait for one to be released or
+        // its transfer to complete, which under polling takes
+        // someone reaping it (sleep)
+        do
+            disk.poll();
+        while (!anyfree());
+    }
+}
+
+buf_t* bget(uint32_t dev, uint32_t blockno) {
+    return bget_(dev, blockno, 0);
+}
+
+// Update the sequential state of dev for a read of blockno
+// and start reading ahead whatever the window now covers
+static void readahead(uint32_t dev, uint32_t blockno) {
+    if (dev >= NDEV)
+        return;
+
+    spinlk_acquire(&ras[dev].lk);
+    if (blockno == ras[dev].next) {
+        ras[dev].window = ras[dev].window ? ras[dev].window * 2 : RA_MIN;
+        if (ras[dev].window > ramax)
+            ras[dev].window = ramax;
+    } else {
+        ras[dev].window /= 2;
+        ras[dev].end = 0; // start the window over from here
+    }
+    ras[dev].next = blockno + 1;
+
+    uint32_t start = ras[dev].end > blockno + 1 ? ras[dev].end : blockno + 1;
+    uint32_t stop = blockno + 1 + ras[dev].window;
+    if (stop > disk.nblocks())
+        stop = disk.nblocks();
+    if (start < stop)
+        ras[dev].end = stop;
+    spinlk_release(&ras[dev].lk);
+
+    for (uint32_t n = start; n < stop; n++) {
+        buf_t *b = bget_(dev, n, 1);
+        if (!b)
+            break; // no buffer to spare
+        if (!b->valid) {
+            b->disk = 1; // before valid, so a reader finding it waits
+            b->valid = 1;
+            b->ra = 1;
+            iosched.submit(b, 0);
+            ra_issued++;
+        }
+        bio.brelease(b);
+    }
 }
 
 buf_t* bread(uint32_t dev, uint32_t blockno) {
     buf_t* b = bget(dev, blockno);
     if (!b->valid) {
+        b->disk = 1; // before valid, so a reader finding it waits
         b->valid = 1;
-        // disk read
-        disk.rw(b, 0);
+        // disk read, waited for below
+        iosched.submit(b, 0);
+    }
+    else if (b->ra) {
+        b->ra = 0;
+        ra_used++;
     }
+    // may still be on its way in if it was read ahead
+    iosched.wait(b);
+    if (ramax)
+        readahead(dev, blockno);
     return b;
 }
 
+void bread_range(uint32_t dev, uint32_t start, int n, buf_t **bs) {
+    bool mine[RANGE_MAX]; // read by this call
+    if (n > RANGE_MAX)
+        kpanic("bread_range: more than RANGE_MAX blocks\n");
+
+    for (int i = 0; i < n; i++) {
+        buf_t *b = bs[i] = bget(dev, start + i);
+        if ((mine[i] = !b->valid)) {
+            b->disk = 1; // before valid, so a reader finding it waits
+            b->valid = 1;
+        }
+        else if (b->ra) {
+            b->ra = 0;
+            ra_used++;
+        }
+    }
+
+    // queued together per run of blocks not cached yet, so the
+    // scheduler can make one request of each, split where the
+    // device's limits say so
+    for (int i = 0; i < n;) {
+        if (!mine[i]) {
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        while (j < n && mine[j])
+            j++;
+        iosched.submitv(bs + i, j - i, 0);
+        i = j;
+    }
+
+    for (int i = 0; i < n; i++)
+        bwait(bs[i]);
+}
+
 void bwrite(buf_t* b)
 {
-    // disk write
-    disk.rw(b, 1);
+    if (!WRITEBACK) {
+        // disk write
+        iosched.rw(b, 1);
+        return;
+    }
+
+    spinlk_acquire(&dirty.lk);
+    if (!b->dirty) {
+        b->dirty = 1;
+        b->dirtied = r_time();
+        b->dnext = 0;
+        b->dprev = dirty.tail;
+        if (dirty.tail)
+            dirty.tail->dnext = b;
+        else
+            dirty.head = b;
+        dirty.tail = b;
+        dirty.n++;
+    }
+    spinlk_release(&dirty.lk);
+
+    // too much unwritten data, the writer pays for a batch
+    if (dirty.n > DIRTY_MAX)
+        flush(1, 0, FLUSH_BATCH);
+}
+
+// Take b off the dirty list, caller must hold dirty.lk
+static void undirty(buf_t *b) {
+    if (b->dprev)
+        b->dprev->dnext = b->dnext;
+    else
+        dirty.head = b->dnext;
+    if (b->dnext)
+        b->dnext->dprev = b->dprev;
+    else
+        dirty.tail = b->dprev;
+    b->dprev = b->dnext = 0;
+    b->dirty = 0;
+    dirty.n--;
+}
+
+void bwait(buf_t *b) {
+    iosched.wait(b);
+}
+
+buf_t* bread_async(uint32_t dev, uint32_t blockno, biodone_t done, void *arg) {
+    buf_t* b = bget(dev, blockno);
+    if (!b->valid) {
+        b->disk = 1; // before valid, so a reader finding it waits
+        b->valid = 1;
+        b->done = done;
+        b->arg = arg;
+        iosched.submit(b, 0);
+    }
+    else {
+        if (b->ra) {
+            b->ra = 0;
+            ra_used++;
+        }
+        // on its way in (read ahead, or another reader's), or
+        // already there
+        if (!iosched.attach(b, done, arg)) {
+            bwait(b);
+            if (done)
+                done(b, arg);
+        }
+    }
+    if (ramax)
+        readahead(dev, blockno);
+    return b;
+}
+
+void write_async(buf_t *b, biodone_t done, void *arg) {
+    // written now, so no need to write it back later
+    spinlk_acquire(&dirty.lk);
+    if (b->dirty)
+        undirty(b);
+    spinlk_release(&dirty.lk);
+
+    // an earlier write-back of b may still be in flight, or
+    // claimed by a flush and not queued yet (b->disk is set
+    // either way)
+    bwait(b);
+    b->done = done;
+    b->arg = arg;
+    iosched.submit(b, 1);
+}
+
+// Write back up to max of the oldest dirty buffers, only those
+// of dev unless all is set, in block order. Returns when they are
+// on disk and returns how many were written. A buffer dirtied
+// again while it is being written goes back on the dirty list,
+// and is skipped until that write is done.
+static int flush(bool all, uint32_t dev, int max) {
+    buf_t *batch[FLUSH_BATCH];
+    int n = 0;
+
+    if (max > FLUSH_BATCH)
+        max = FLUSH_BATCH;
+
+    spinlk_acquire(&dirty.lk);
+    for (buf_t *b = dirty.head, *next; b && n < max; b = next) {
+        next = b->dnext;
+        if (!all && b->dev != dev)
+            continue;
+        // an earlier write of it is still in flight, it is
+        // left for a later flush
+        if (b->disk)
+            continue;
+        // hold a reference before it stops being dirty so
+        // that it can't be reused until written
+        shard_t *s = SHARD(b->dev, b->blockno);
+        spinlk_acquire(&s->lk);
+        if (!b->refct++)
+            unfree(s, b);
+        spinlk_release(&s->lk);
+        undirty(b);
+        dirty.claimed[WBSLOT(b->dev)]++;
+        // busy from now, so that write_async or zap finding it
+        // no longer dirty wait for this write before their own
+        b->disk = 1;
+        batch[n++] = b;
+    }
+    spinlk_release(&dirty.lk);
+
+    if (!n)
+        return 0;
+
+    // sort by (dev, blockno)
+    for (int i = 1; i < n; i++) {
+        buf_t *b = batch[i];
+        int j = i - 1;
+        for (; j >= 0 && (batch[j]->dev > b->dev ||
+                (batch[j]->dev == b->dev && batch[j]->blockno > b->blockno)); j--)
+            batch[j + 1] = batch[j];
+        batch[j + 1] = b;
+    }
+
+    // queued at once, in block order, so that runs of
+    // consecutive blocks become one request each
+    iosched.submitv(batch, n, 1);
+    for (int i = 0; i < n; i++)
+        iosched.wait(batch[i]);
+    spinlk_acquire(&dirty.lk);
+    for (int i = 0; i < n; i++)
+        dirty.claimed[WBSLOT(batch[i]->dev)]--;
+    spinlk_release(&dirty.lk);
+    for (int i = 0; i < n; i++)
+        brelease(batch[i]);
+
+    wb_flushes++;
+    wb_written += n;
+    return n;
+}
+
+// Whether dev has dirty buffers or write-backs in flight
+static bool pending(uint32_t dev) {
+    spinlk_acquire(&dirty.lk);
+    bool r = dirty.claimed[WBSLOT(dev)] != 0;
+    for (buf_t *b = dirty.head; b && !r; b = b->dnext)
+        r = b->dev == dev;
+    spinlk_release(&dirty.lk);
+    return r;
+}
+
+void sync(uint32_t dev) {
+    for (;;) {
+        if (flush(0, dev, FLUSH_BATCH))
+            continue;
+        // left: blocks other harts' flushes took off the list
+        // first, not dirty anymore but not on disk yet either,
+        // and dirty ones flush skipped while in flight
+        if (!pending(dev))
+            break;
+        disk.poll();
+    }
+}
+
+void flush_idle() {
+    buf_t *oldest = dirty.head; // racy peek
+    if (dirty.n > DIRTY_HIGH || (oldest && r_time() - oldest->dirtied > DIRTY_AGE))
+        flush(1, 0, FLUSH_BATCH);
 }
 
 void brelease(buf_t *b) {
-    spinlk_acquire(&lk);
+    shard_t *s = SHARD(b->dev, b->blockno);
+    spinlk_acquire(&s->lk);
 
     b->refct--;
 
-    if (!b->refct) {
-        b->next = mru;
-        b->prev = 0;
-        mru->prev = b;
-        mru = b;
-        if (b == lru)
-            lru = lru->prev;
+    if (!b->refct)
+        putfree(s, b);
+
+    spinlk_release(&s->lk);
+}
+
+int grow(int n) {
+    spinlk_acquire(&sizelk);
+    n = grow_locked(n);
+    if (nbuf > maxbuf)
+        maxbuf = nbuf;
+    spinlk_release(&sizelk);
+    return n;
+}
+
+// Drop least recently used buffers first, round robin over the shards
+int shrink(int n) {
+    int i = 0;
+    spinlk_acquire(&sizelk);
+    for (int k = 0, idle = 0; i < n && nbuf > MINBUF && idle < NSHARD; k++) {
+        shard_t *s = &shards[k % NSHARD];
+        spinlk_acquire(&s->lk);
+        buf_t *b = victim(s);
+        if (b) {
+            unfree(s, b);
+            unhash(b);
+            s->nbuf--;
+        }
+        spinlk_release(&s->lk);
+        if (!b) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        kmem_cache_free(datacache, b->data);
+        kmem_cache_free(bufcache, b);
+        nbuf--;
+        i++;
+    }
+    spinlk_release(&sizelk);
+    return i;
+}
+
+void counters(uint64_t *hits, uint64_t *misses) {
+    *hits = *misses = 0;
+    for (int i = 0; i < NSHARD; i++) {
+        *hits += shards[i].hits;
+        *misses += shards[i].misses;
     }
+}
+
+void stats() {
+    uint64_t hits = 0, misses = 0;
+    for (int i = 0; i < NSHARD; i++) {
+        shard_t *s = &shards[i];
+        kprintf("bio: shard %d: %d buffers, %d free, %d hits, %d misses, %d steals\n",
+                i, s->nbuf, s->nfree, (int)s->hits, (int)s->misses, (int)s->steals);
+#if BIO_POLICY == BIO_2Q
+        kprintf("bio: shard %d: %d on A1in, %d A1out hits\n", i, s->nin, (int)s->ghits);
+#endif
+        hits += s->hits;
+        misses += s->misses;
+    }
+    kprintf("bio: %d buffers, %d%% hit\n", nbuf,
+            hits + misses ? (int)(hits * 100 / (hits + misses)) : 0);
+    kprintf("bio: read-ahead: %d read, %d used, %d wasted\n",
+            (int)ra_issued, (int)ra_used, (int)ra_wasted);
+    kprintf("bio: write-back: %d dirty, %d written in %d batches\n",
+            dirty.n, (int)wb_written, (int)wb_flushes);
+}
+
+void setra(int max) {
+    ramax = max < 0 ? 0 : max;
+}
+
+// A referenced buffer for the block if it is cached, 0 if not
+static buf_t *bpeek(uint32_t dev, uint32_t blockno) {
+    shard_t *s = SHARD(dev, blockno);
+    spinlk_acquire(&s->lk);
+    buf_t *p = htbl[HASH(dev, blockno)];
+    for (; p; p = p->hnext)
+        if (p->dev == dev && p->blockno == blockno) {
+            if (!p->refct++)
+                unfree(s, p);
+            break;
+        }
+    spinlk_release(&s->lk);
+    return p;
+}
+
+// Bring cached copies of n blocks from start in line with a
+// discard or write zeroes of them: nothing in flight, nothing
+// left to write back, and zeroes. Discarded blocks no one else
+// holds are dropped from the cache instead (read back from the
+// disk if needed again) and their buffers reused first.
+static void zap(uint32_t dev, uint32_t start, uint32_t n, bool drop) {
+    for (uint32_t i = start; i < start + n; i++) {
+        buf_t *b = bpeek(dev, i);
+        if (!b)
+            continue;
+        // no longer dirty first, then a write-back a flush has
+        // claimed is waited for too
+        spinlk_acquire(&dirty.lk);
+        if (b->dirty)
+            undirty(b);
+        spinlk_release(&dirty.lk);
+        bwait(b);
+        shard_t *s = SHARD(dev, i);
+        spinlk_acquire(&s->lk);
+        if (drop && b->refct == 1) {
+            b->refct = 0;
+            b->valid = 0;
+            putstale(s, b);
+            spinlk_release(&s->lk);
+            continue;
+        }
+        spinlk_release(&s->lk);
+        if (b->valid)
+            memset(b->data, 0, BSIZE);
+        brelease(b);
+    }
+}
+
+// Run a DISK_* request over n blocks from start, split as the
+// device needs, and return when it is done
+static void blkop(int op, uint32_t dev, uint32_t start, uint32_t n) {
+    buf_t h = {0}; // the handle, no data
+    h.dev = dev;
+    while (n) {
+        h.blockno = start;
+        uint32_t k;
+        while (!(k = disk.submitop(&h, op, n)))
+            disk.poll(); // full (sleep)
+        disk.wait(&h);
+        start += k;
+        n -= k;
+    }
+}
+
+void discard(uint32_t dev, uint32_t start, uint32_t n) {
+    zap(dev, start, n, 1);
+    if (disk.can(DISK_DISCARD))
+        blkop(DISK_DISCARD, dev, start, n);
+}
+
+void zero_range(uint32_t dev, uint32_t start, uint32_t n) {
+    if (disk.can(DISK_ZERO)) {
+        zap(dev, start, n, 0);
+        blkop(DISK_ZERO, dev, start, n);
+        return;
+    }
+    for (uint32_t i = start; i < start + n; i++) {
+        buf_t *b = bget(dev, i);
+        bwait(b);
+        memset(b->data, 0, BSIZE);
+        b->valid = 1;
+        bwrite(b);
+        brelease(b);
+    }
+}
 
-    spinlk_release(&lk);
+void bflush(uint32_t dev) {
+    if (disk.can(DISK_FLUSH))
+        blkop(DISK_FLUSH, dev, 0, 1);
 }
@@ -8,52 +8,275 @@
 #include "../include/util.h"
 #include "../include/bio.h"
 #include "../include/sync.h"
-
-// Descriptor table
-static struct {
-    desc_t arr[NUMDESC];
-    bool status[NUMDESC];
-} desctbl;
-
-driverq_t driverq;
-deviceq_t deviceq;
-// The device may process our requests
-// faster than the kernel can process 
-// its response due to the interruptiblity
-// of the kernel routines. So, we need
-// an extra idx to keep track of our 
-// own progress in processing the device 
-// response
-uint16_t idx; // we have handled this much of reponses in the queue
-
-// each requests will be assigned to an a `req_t` struct
-// which is used in forming first descriptor as the "header",
-// indicating which block to operate on and the operation type
-req_t reqs[NUMDESC];
-
-// Mutual exclusion locks between cores
-static spinlk_t lk = SPINLK_INITIALIZER;
-
-// Keep track of in-flight transactions
-static struct {
-  buf_t *bufs[NUMDESC];
-  char status[NUMDESC];
-} txns;
+#include "../include/slab.h"
+#include "../include/kprintf.h"
+#include "../include/hart.h"
+#include "../include/timer.h"
+
+/*
+    Requests are pipelined: submit fills in a descriptor chain,
+    puts its head on the driver queue, notifies the device and
+    returns. Any number of requests, up to what the descriptors
+    allow, are in flight at once. Completions are only handled
+    by isr, which retires every request the device has put on the
+    device queue since the last interrupt and hands the buffers
+    back (b->disk = 0, b->done).
+
+    The queue has as many descriptors as the device allows
+    (QUEUE_SIZE_MAX, capped at QSIZE_MAX), allocated at init.
+    Free descriptors are kept on a list linked through their next
+    field, so taking or returning one is O(1):
+
+    free -> [5] -> [2] -> [7] -> ... (nfree of them)
+
+    With VIRTIO_RING_F_INDIRECT_DESC negotiated, a request's
+    header, data and status descriptors go in an indirect table
+    of its own, from the "vindirect" slab cache, and the ring
+    holds a single descriptor pointing at it. Every ring slot can
+    then carry a whole request:
+
+    desc[3] INDIRECT --> [header][data]...[data][status]
+
+    If no table can be allocated the request falls back to a
+    chain in the ring.
+
+    With VIRTIO_RING_F_EVENT_IDX negotiated, notifications go
+    both ways only when asked for. submit writes QUEUE_NOTIFY
+    only if the device's avail_event says it is waiting for a
+    request it hasn't seen, so a device busy draining the queue
+    isn't kicked for every request. isr sets used_event so that
+    the next interrupt comes once half of the requests still in
+    flight are done, not for every one of them; if the last
+    completions are already past it, isr goes around again as
+    no interrupt will come for them.
+
+    With VIRTIO_BLK_F_MQ negotiated there is one queue per hart,
+    up to the device's num_queues, each with its own lock, and a
+    hart only submits to its own (hart % nvq), so harts doing I/O
+    at the same time don't share a ring or a lock. virtio-mmio
+    has a single interrupt line for the device, not one per
+    queue, so interrupts can't be steered to the owning hart;
+    the hart the PLIC hands the interrupt to reaps every queue,
+    starting with its own.
+
+    Completions can also be polled (disk.setmode). In DISK_POLL
+    mode queues ask the device for no interrupts at all (used_event
+    left behind, or AVAIL_FLG_MSK_NO_INTERRUPT), and disk.wait
+    reaps the waited-on buffer's queue itself until the buffer is
+    done, skipping the PLIC and the trap path. Completions no one
+    waits on are reaped by idle harts (disk.poll), and disk.rw
+    finding its queue full reaps while it waits for room. submit
+    itself never reaps, as the I/O scheduler calls it with its
+    lock held and reaping runs callbacks that may come back to
+    the scheduler; the scheduler polls once it has let go. In
+    DISK_HYBRID mode a waiter polls for spin_us and then registers
+    as a sleeper on the queue; a queue with sleepers has its
+    interrupts on until they are gone.
+
+    Besides reads and writes, submitop starts flushes, discards
+    and write zeroes (VIRTIO_BLK_F_FLUSH, _DISCARD, _WRITE_ZEROES)
+    with a buffer as the handle and no data of its own: a flush
+    is a header and a status, the other two carry a range_t,
+    kept per request like the header, as their one segment. With
+    FLUSH the device's write cache is turned on (CONFIG_WCE).
+
+    With VIRTIO_F_RING_PACKED negotiated (QEMU's packed=on) each
+    queue is a single ring of descriptors instead of a table, an
+    available ring and a used ring. submit writes a request's
+    descriptors into the next free slots, the head's flags last,
+    and the device overwrites the head slot in place when done:
+
+            used            avail
+             v                v
+    ring: [done][busy][busy][free][free] ...
+
+    A slot's AVAIL and USED flag bits against the driver's wrap
+    counters tell which of the three it is, so the driver reads
+    one cache line per completion rather than the used ring and
+    then the descriptor table. Requests are told apart by a buffer
+    id, taken off a free list of ids, that the device hands back;
+    it indexes reqs, bufs and status as the head descriptor does
+    on a split ring. Interrupts are turned on and off with the
+    event suppression structures' ENABLE and DISABLE; the device's
+    DESC event is honored when kicking.
+*/
+
+typedef struct vq {
+    spinlk_t lk;        // guards everything below
+    uint16_t id;        // queue index on the device
+    uint16_t size;      // descriptors in the queue
+    desc_t *desc;       // descriptor table
+    driverq_t *driverq;
+    deviceq_t *deviceq;
+    // The device may process our requests
+    // faster than the kernel can process
+    // its response due to the interruptiblity
+    // of the kernel routines. So, we need
+    // an extra idx to keep track of our
+    // own progress in processing the device
+    // response
+    uint16_t idx;       // we have handled this much of reponses in the queue
+    uint16_t free;      // first free descriptor
+    uint16_t nfree;
+    uint16_t inflight;  // requests submitted and not retired
+    int sleepers;       // DISK_HYBRID waiters that gave up polling
+    uint64_t reqs_done; // requests retired
+    uint64_t kicks;     // QUEUE_NOTIFY writes
+    // packed ring, if negotiated, in place of desc, driverq,
+    // deviceq and the descriptor free list
+    bool packed;
+    pdesc_t *ring;
+    pevent_t *drvevent; // written by us
+    pevent_t *devevent; // written by the device
+    uint16_t avail;     // next slot to make available
+    uint16_t used;      // next slot the device will mark used
+    bool availwrap;     // wrap counters, flip each time around the ring
+    bool usedwrap;
+    uint16_t freeid;    // first free buffer id
+    uint16_t *idnext;   // free buffer ids, linked
+    uint16_t *ndesc;    // ring slots held by each buffer id
+    pdesc_t **tbls;     // indirect table of each buffer id, or 0
+    // each requests will be assigned to an a `req_t` struct,
+    // indexed by its head descriptor, which is used in forming
+    // the first descriptor as the "header", indicating which
+    // block to operate on and the operation type
+    req_t *reqs;
+    range_t *ranges;    // data of discards and write zeroes, by head descriptor too
+    // Keep track of in-flight transactions, by head descriptor
+    buf_t **bufs;
+    char *status;
+} __attribute__((aligned(64))) vq_t; // one cache line apart so harts don't false share
+
+static vq_t vqs[NCPU];
+static int nvq;      // queues set up, hart h submits to vqs[h % nvq]
+static bool eventidx; // VIRTIO_RING_F_EVENT_IDX negotiated
+static bool packed;   // VIRTIO_F_RING_PACKED negotiated
 
 static void init();
 static void rw(buf_t* b, bool w);
+static void reap(struct vq *q);
 static void isr();
+static bool submit(buf_t *b, bool w);
+static int submitv(buf_t **bs, int n, bool w);
+static bool attach(buf_t *b, biodone_t done, void *arg);
+static uint32_t nblocks();
+static void stats();
+static void wait(buf_t *b);
+static void poll();
+static void setmode(int mode, int spin_us);
+static int inflight(int q);
+static void setready(void (*fn)(int q));
+static bool can(int op);
+static uint32_t submitop(buf_t *b, int op, uint32_t n);
+static int nqueues();
+static int submitq(int q, buf_t **bs, int n, bool w);
+
+disk_t disk = {init, rw, isr, submit, submitv, attach, nblocks, stats, wait, poll, setmode,
+               inflight, setready, can, submitop, nqueues, submitq};
+
+static uint64_t capacity; // in 512-byte sectors
+static uint32_t size_max = ~0; // largest data segment
+static uint32_t seg_max = RANGE_MAX; // most data segments in a request
+static kmem_cache_t *indcache; // indirect tables, 0 if not negotiated
+static uint64_t intrs; // isr calls, racy, only a statistic
+static int mode = DISK_INTR;
+static uint64_t spin_ticks; // DISK_HYBRID polling time
+static void (*ready)(int q); // called after requests on q complete
+static uint32_t opmax[3];   // most blocks a DISK_* request takes, 0 if the device can't
+static uint64_t opcount[3]; // DISK_* requests started
+static bool wcache;         // the device has a write cache on
+
+// Zeroed memory for n bytes of queue, from whole pages
+static void *qalloc(uint64_t n) {
+    int order = 0;
+    while ((PGSIZE << order) < n)
+        order++;
+    void *p = (void *)pmmngr.alloc_pages(order);
+    if (!p)
+        kpanic("virtio: no memory for the queue\n");
+    memset(p, 0, PGSIZE << order);
+    return p;
+}
+
+// select queue i and initialize it
+static void initq(int i) {
+    vq_t *q = &vqs[i];
+    *REG(MMIO_QUEUE_SEL) = i;
+    if(*REG(MMIO_QUEUE_READY))
+        kpanic("virtio queue not ready\n");
+
+    // check maximum queue size, take all of it
+    uint32_t max = *REG(MMIO_QUEUE_SIZE_MAX);
+    if(max == 0)
+        kpanic("virtio has no queue");
+    if(max < 3)
+        kpanic("virtio max queue too short");
+    // a power of two, so ring indices wrap with the 16-bit idx
+    for (q->size = QSIZE_MAX; q->size > max; q->size >>= 1)
+        ;
+    *REG(MMIO_QUEUE_SIZE) = q->size;
+
+    q->reqs = qalloc(q->size * sizeof(req_t));
+    q->ranges = qalloc(q->size * sizeof(range_t));
+    q->bufs = qalloc(q->size * sizeof(buf_t *));
+    q->status = qalloc(q->size);
+    q->nfree = q->size;
+
+    if (packed) {
+        // the ring in place of the table, the event suppression
+        // structures in place of the driver and device queues
+        q->packed = 1;
+        q->ring = qalloc(q->size * sizeof(pdesc_t));
+        q->drvevent = qalloc(sizeof(pevent_t));
+        q->devevent = qalloc(sizeof(pevent_t));
+        q->idnext = qalloc(q->size * sizeof(uint16_t));
+        q->ndesc = qalloc(q->size * sizeof(uint16_t));
+        q->tbls = qalloc(q->size * sizeof(pdesc_t *));
+        q->availwrap = q->usedwrap = 1;
+        for (int j = 0; j < q->size; j++)
+            q->idnext[j] = j + 1;
+        q->freeid = 0;
+        *REG(MMIO_DESC_TABLE_LOW) = (uint64_t)q->ring;
+        *REG(MMIO_DESC_TABLE_HIGH) = (uint64_t)q->ring >> 32;
+        *REG(MMIO_DEVICE_QUEUE_LOW) = (uint64_t)q->devevent;
+        *REG(MMIO_DEVICE_QUEUE_HIGH) = (uint64_t)q->devevent >> 32;
+        *REG(MMIO_DRIVER_QUEUE_LOW) = (uint64_t)q->drvevent;
+        *REG(MMIO_DRIVER_QUEUE_HIGH) = (uint64_t)q->drvevent >> 32;
+    }
+    else {
+        q->desc = qalloc(q->size * sizeof(desc_t));
+        // + used_event or avail_event after the ring
+        q->driverq = qalloc(sizeof(driverq_t) + q->size * sizeof(uint16_t) + 2);
+        q->deviceq = qalloc(sizeof(deviceq_t) + q->size * 8 + 2);
+
+        // inform virtio of the starting address of the memory blocks we allocated for queueing
+        *REG(MMIO_DESC_TABLE_LOW) = (uint64_t)q->desc;
+        *REG(MMIO_DESC_TABLE_HIGH) = (uint64_t)q->desc >> 32;
+        *REG(MMIO_DEVICE_QUEUE_LOW) = (uint64_t)q->deviceq;
+        *REG(MMIO_DEVICE_QUEUE_HIGH) = (uint64_t)q->deviceq >> 32;
+        *REG(MMIO_DRIVER_QUEUE_LOW) = (uint64_t)q->driverq;
+        *REG(MMIO_DRIVER_QUEUE_HIGH) = (uint64_t)q->driverq >> 32;
+
+        // all descriptors start unsued
+        for (int j = 0; j < q->size; j++)
+            q->desc[j].next = j + 1;
+        q->free = 0;
+    }
+    q->id = i;
+    spinlk_init(&q->lk);
 
-disk_t disk = {init, rw, isr};
+    // queue ready
+    *REG(MMIO_QUEUE_READY) = 1;
+}
 
 // initilization process is described in spec's section 3.1
 // for Virtqueue initialization, refer to spec's section 4.2.3.2
 void init() {
     // does the system supports virtio disk?
-    if (*REG(MMIO_MAGIC_VALUE) != 0x74726976 || 
+    if (*REG(MMIO_MAGIC_VALUE) != 0x74726976 ||
         *REG(MMIO_VERSION) != 2 ||
-        *REG(MMIO_DEVICE_ID) != 2 || 
-        *REG(MMIO_VENDOR_ID) != 0x554d4551) 
+        *REG(MMIO_DEVICE_ID) != 2 ||
+        *REG(MMIO_VENDOR_ID) != 0x554d4551)
             kpanic("virtio device not found: disk\n");
 
 
@@ -69,16 +292,27 @@ void init() {
     *REG(MMIO_STATUS) = status;
 
     // negotiate features with the device (picking the interection)
+    *REG(MMIO_DEVICE_FEATURES_SEL) = 0;
     uint32_t features = *REG(MMIO_DEVICE_FEATURES);
     features &= ~(1 << BLK_FEATURE_BIT_RO);
     features &= ~(1 << BLK_FEATURE_BIT_SCSI);
-    features &= ~(1 << BLK_FEATURE_BIT_CONFIG_WCE);
-    features &= ~(1 << BLK_FEATURE_BIT_MQ);
+    // a write cache only if it can be flushed
+    if (!(features & (1 << BLK_FEATURE_BIT_FLUSH)))
+        features &= ~(1 << BLK_FEATURE_BIT_CONFIG_WCE);
     features &= ~(1 << QUEUE_FEATURE_BIT_ANY_LAYOUT);
-    features &= ~(1 << QUEUE_FEATURE_BIT_EVENT_IDX);
-    features &= ~(1 << QUEUE_FEATURE_BIT_INDIRECT_DESC);
+    *REG(MMIO_DRIVER_FEATURES_SEL) = 0;
     *REG(MMIO_DRIVER_FEATURES) = features;
 
+    // the high 32 bits: only taken for the packed ring, which
+    // needs VIRTIO_F_VERSION_1 with it; split otherwise
+    *REG(MMIO_DEVICE_FEATURES_SEL) = 1;
+    uint32_t features_hi = 0;
+    if (*REG(MMIO_DEVICE_FEATURES) & (1 << QUEUE_FEATURE_BIT_RING_PACKED))
+        features_hi = 1 << FEATURE_BIT_VERSION_1 | 1 << QUEUE_FEATURE_BIT_RING_PACKED;
+    *REG(MMIO_DRIVER_FEATURES_SEL) = 1;
+    *REG(MMIO_DRIVER_FEATURES) = features_hi;
+    packed = features_hi != 0;
+
     // single the device that the negotiation's complete
     status |= DEVICE_STATUS_MSK_FEATURES_OK;
     *REG(MMIO_STATUS) = status;
@@ -86,161 +320,601 @@ void init() {
     // make sure DEVICE_STATUS_MSK_FEATURES_OK is set
     if (!(*REG(MMIO_STATUS) & DEVICE_STATUS_MSK_FEATURES_OK))
         kpanic("failed to set FEATURES_OK\n");
-    
-    // select queue 0 and initialize it
-    *REG(MMIO_QUEUE_SEL) = 0;
-    if(*REG(MMIO_QUEUE_READY))
-        kpanic("virtio queue not ready\n");
-    
-    // check maximum queue size
-    uint32_t max = *REG(MMIO_QUEUE_SIZE_MAX);
-    if(max == 0)
-        kpanic("virtio has no queue 0");
-    if(max < NUMDESC)
-        kpanic("virtio max queue too short");
-
-    // inform virtio of the starting address of the memory blocks we allocated for queueing
-    *REG(MMIO_DESC_TABLE_LOW) = (uint64_t)desctbl.arr;
-    *REG(MMIO_DESC_TABLE_HIGH) = (uint64_t)desctbl.arr >> 32;
-    *REG(MMIO_DEVICE_QUEUE_LOW) = (uint64_t)&deviceq;
-    *REG(MMIO_DEVICE_QUEUE_HIGH) = (uint64_t)&deviceq >> 32;
-    *REG(MMIO_DRIVER_QUEUE_LOW) = (uint64_t)&driverq;
-    *REG(MMIO_DRIVER_QUEUE_HIGH) = (uint64_t)&driverq >> 32;
-
-    // queue ready
-    *REG(MMIO_QUEUE_READY) = 1;
 
-    // all descriptors start unsued
-    for (int i = 0; i < NUMDESC; i++)
-        desctbl.status[i] = 1;
+    // one queue per hart if the device has that many
+    nvq = 1;
+    if (features & (1 << BLK_FEATURE_BIT_MQ)) {
+        nvq = *(volatile uint16_t *)REG(MMIO_CONFIG + BLK_CONFIG_NUM_QUEUES);
+        if (nvq > NCPU)
+            nvq = NCPU;
+        if (nvq < 1)
+            nvq = 1;
+    }
+    for (int i = 0; i < nvq; i++)
+        initq(i);
+
+    capacity = *(volatile uint64_t *)REG(MMIO_CONFIG + BLK_CONFIG_CAPACITY);
+    if (features & (1 << BLK_FEATURE_BIT_SIZE_MAX))
+        size_max = *REG(MMIO_CONFIG + BLK_CONFIG_SIZE_MAX);
+    if (features & (1 << BLK_FEATURE_BIT_SEG_MAX) &&
+        *REG(MMIO_CONFIG + BLK_CONFIG_SEG_MAX) < seg_max)
+        seg_max = *REG(MMIO_CONFIG + BLK_CONFIG_SEG_MAX);
+    for (int i = 0; i < nvq; i++)
+        if (seg_max > vqs[i].size - 2)
+            seg_max = vqs[i].size - 2;
+    if (size_max < BSIZE || !seg_max)
+        kpanic("virtio disk can't take a block per request\n");
+    eventidx = features & (1 << QUEUE_FEATURE_BIT_EVENT_IDX);
+    // flush, discard and write zeroes; the limits are in sectors
+    if (features & (1 << BLK_FEATURE_BIT_FLUSH))
+        opmax[DISK_FLUSH] = 1;
+    if (features & (1 << BLK_FEATURE_BIT_DISCARD))
+        opmax[DISK_DISCARD] = *REG(MMIO_CONFIG + BLK_CONFIG_MAX_DISCARD_SECTORS) / (BSIZE / 512);
+    if (features & (1 << BLK_FEATURE_BIT_WRITE_ZEROES))
+        opmax[DISK_ZERO] = *REG(MMIO_CONFIG + BLK_CONFIG_MAX_WZEROES_SECTORS) / (BSIZE / 512);
+
+    // with a cache that can be flushed, writes may complete once
+    // they are in it; bio.flush makes them durable
+    volatile uint8_t *writeback = (volatile uint8_t *)REG(MMIO_CONFIG + BLK_CONFIG_WRITEBACK);
+    if (features & (1 << BLK_FEATURE_BIT_CONFIG_WCE))
+        *writeback = 1;
+    // without CONFIG_WCE, a device offering FLUSH caches writes
+    wcache = features & (1 << BLK_FEATURE_BIT_CONFIG_WCE) ? *writeback :
+             features & (1 << BLK_FEATURE_BIT_FLUSH);
+
+    // desc_t and pdesc_t are the same size, so are their tables
+    if (features & (1 << QUEUE_FEATURE_BIT_INDIRECT_DESC))
+        indcache = kmem_cache_create("vindirect", (seg_max + 2) * sizeof(desc_t), sizeof(desc_t));
 
     // device ready
     status |= DEVICE_STATUS_MSK_DRIVER_OK;
     *REG(MMIO_STATUS) = status;
 }
 
-static int alloc_desc() {
-    for (int i = 0; i < NUMDESC; i++)
-        if (desctbl.status[i]) {
-            desctbl.status[i] = 0;
-            return i;
-        }
-    return -1;
-}
-
-static void free_desc(int idx) {
-    desctbl.status[idx] = 1;
-    desctbl.arr[idx].addr = 0;
-    desctbl.arr[idx].len = 0;
-    desctbl.arr[idx].flgs = 0;
-    desctbl.arr[idx].next = 0;
-    // wake up the processes waiting on the completion of the work described by descriptor
-    // to be completed...
-}
-
-static int alloc3_desc(int indices[3])
-{
-    for(int i = 0; i < 3; i++){
-        indices[i] = alloc_desc();
-        if(indices[i] < 0){
-        // free all previously allocated descriptors on a failure 
-        for(int j = 0; j < i; j++)
-            free_desc(indices[j]);
+uint32_t nblocks() {
+    return capacity / (BSIZE / 512);
+}
+
+// Take a chain of n descriptors off the free list, linked
+// through next, and return its head, -1 if there aren't n
+// caller must hold q->lk
+static int alloc_chain(vq_t *q, int n) {
+    if (q->nfree < n)
         return -1;
-      }
+    int head = q->free;
+    int last = head;
+    for (int i = 1; i < n; i++)
+        last = q->desc[last].next;
+    q->free = q->desc[last].next;
+    q->nfree -= n;
+    return head;
+}
+
+// Put the chain of descriptors starting at idx back on the
+// free list, and its indirect table back in the cache, caller
+// must hold q->lk
+static void free_chain(vq_t *q, int idx) {
+    if (q->desc[idx].flgs & DESC_FLG_MSK_INDIRECT)
+        kmem_cache_free(indcache, (void *)q->desc[idx].addr);
+    int last = idx, n = 1;
+    while (q->desc[last].flgs & DESC_FLG_MSK_NEXT) {
+        last = q->desc[last].next;
+        n++;
     }
-    return 0;
+    q->desc[last].next = q->free;
+    q->free = idx;
+    q->nfree += n;
 }
 
+// Walks the data segments of a request: runs of blocks whose
+// data is contiguous in memory, at most size_max bytes each, or
+// the one segment at addr if len is set
+typedef struct segs {
+    buf_t **bs;
+    int n;
+    int i; // blocks walked so far
+    uint64_t addr;
+    uint32_t len;
+} segs_t;
+
+static bool nextseg(segs_t *s, uint64_t *addr, uint32_t *len) {
+    if (s->len) {
+        *addr = s->addr;
+        *len = s->len;
+        s->len = 0;
+        return 1;
+    }
+    if (s->i == s->n)
+        return 0;
+    *addr = (uint64_t)s->bs[s->i]->data;
+    *len = BSIZE;
+    for (s->i++; s->i < s->n; s->i++) {
+        if (s->bs[s->i]->data != s->bs[s->i - 1]->data + BSIZE ||
+            *len + BSIZE > size_max)
+            break;
+        *len += BSIZE;
+    }
+    return 1;
+}
 
-static void free3_desc(int idx) {
-    for (int i = 0; i < 3; i++) {
-        int old_idx = idx;
-        int idx = desctbl.arr[idx].next;
-        free_desc(old_idx);
+// fill in the header, and the range of a discard or write
+// zeroes of nsect sectors, and hand the buffers to the request
+// id, chained through rqnext, caller must hold q->lk
+static void record(vq_t *q, int id, buf_t **bs, int nbuf, int op, uint32_t nsect) {
+    q->reqs[id].op = op;
+    q->reqs[id].sector = op == BLK_OP_FLUSH ? 0 : bs[0]->blockno * (BSIZE / 512);
+    q->reqs[id].reserved = 0;
+    q->ranges[id].sector = q->reqs[id].sector;
+    q->ranges[id].nsect = nsect;
+    q->ranges[id].flgs = 0;
+    q->status[id] = 1;
+    for (int i = 0; i < nbuf; i++) {
+        bs[i]->disk = 1;
+        bs[i]->queue = q->id;
+        bs[i]->rqnext = i + 1 < nbuf ? bs[i + 1] : 0;
     }
+    q->bufs[id] = bs[0];
 }
 
-// disk read and write
-static void rw(buf_t* b, bool w) {
+// the data segments of request id: its buffers' data for a
+// read or write, its range for a discard or write zeroes, none
+// for a flush
+static segs_t segsof(vq_t *q, int id, buf_t **bs, int nbuf, int op) {
+    segs_t s = {bs, nbuf, 0, 0, 0};
+    if (op == BLK_OP_FLUSH)
+        s.n = 0;
+    else if (op != BLK_OP_R && op != BLK_OP_W) {
+        s.addr = (uint64_t)&q->ranges[id];
+        s.len = sizeof(range_t);
+    }
+    return s;
+}
 
-    uint64_t sect = b->blockno * (BSIZE / 512);
+static void kick(vq_t *q) {
+    *REG(MMIO_QUEUE_NOTIFY) = q->id;
+    q->kicks++;
+}
 
+// split ring: the chain in an indirect table, tbl, with one
+// descriptor pointing at it, or in the descriptor table itself
+static bool submit_split(vq_t *q, buf_t **bs, int nbuf, int nseg, int op, uint32_t nsect) {
+    desc_t *tbl = 0, *desc;
+    int idx1;
+    if (indcache && (tbl = kmem_cache_alloc(indcache))) {
+        if ((idx1 = alloc_chain(q, 1)) < 0) {
+            kmem_cache_free(indcache, tbl);
+            return 0;
+        }
+        for (int i = 0; i < nseg + 2; i++)
+            tbl[i].next = i + 1;
+        q->desc[idx1].addr = (uint64_t)tbl;
+        q->desc[idx1].len = (nseg + 2) * sizeof(desc_t);
+        q->desc[idx1].flgs = DESC_FLG_MSK_INDIRECT;
+        desc = tbl;
+    }
+    else {
+        if ((idx1 = alloc_chain(q, nseg + 2)) < 0)
+            return 0;
+        desc = &q->desc[idx1];
+    }
+    record(q, idx1, bs, nbuf, op, nsect);
+
+    desc->addr = (uint64_t)&q->reqs[idx1];
+    desc->len = sizeof(req_t);
+    desc->flgs = DESC_FLG_MSK_NEXT;
+
+    // the data segments; the chain's next links are already
+    // in place
+    segs_t s = segsof(q, idx1, bs, nbuf, op);
+    uint64_t addr;
+    uint32_t len;
+    while (nextseg(&s, &addr, &len)) {
+        desc = tbl ? desc + 1 : &q->desc[desc->next];
+        desc->addr = addr;
+        desc->len = len;
+        desc->flgs = DESC_FLG_MSK_NEXT | (op == BLK_OP_R ? DESC_FLG_MSK_WRITE : 0);
+    }
 
-    int indices[3];
-    while (1) {
-        if (!alloc3_desc(indices))
-            break;
-        // sleep
+    desc = tbl ? desc + 1 : &q->desc[desc->next];
+    desc->addr = (uint64_t)&q->status[idx1];
+    desc->len = 1;
+    desc->flgs = DESC_FLG_MSK_WRITE; // last in chain
+
+    // write driver queue
+    uint16_t old = q->driverq->idx;
+    q->driverq->ring[old % q->size] = idx1;
+
+    // update driver queue index
+    sync();
+    q->driverq->idx = old + 1;
+    sync();
+
+    if (!eventidx || NEED_EVENT(AVAIL_EVENT(q->deviceq, q->size), old + 1, old))
+        kick(q);
+    return 1;
+}
+
+// Write the k-th slot past avail as available, and return its
+// flags. The head's (k = 0) are left for the caller to write
+// last, as they are what makes the whole chain available.
+static uint16_t pput(vq_t *q, int k, uint64_t addr, uint32_t len, uint16_t flgs, uint16_t id) {
+    int slot = q->avail + k;
+    bool wrap = q->availwrap;
+    if (slot >= q->size) {
+        slot -= q->size;
+        wrap = !wrap;
     }
+    pdesc_t *d = &q->ring[slot];
+    d->addr = addr;
+    d->len = len;
+    d->id = id;
+    flgs |= wrap ? PDESC_FLG_MSK_AVAIL : PDESC_FLG_MSK_USED;
+    if (k)
+        d->flgs = flgs;
+    return flgs;
+}
 
-    uint16_t idx1 = indices[0];
-    uint16_t idx2 = indices[1];
-    uint16_t idx3 = indices[2];
+// packed ring: the chain in an indirect table with one slot
+// pointing at it, or in nseg + 2 slots of the ring
+static bool submit_packed(vq_t *q, buf_t **bs, int nbuf, int nseg, int op, uint32_t nsect) {
+    pdesc_t *tbl = indcache ? kmem_cache_alloc(indcache) : 0;
+    int nslot = tbl ? 1 : nseg + 2;
+    if (q->nfree < nslot) {
+        if (tbl)
+            kmem_cache_free(indcache, tbl);
+        return 0;
+    }
+    // ids can't run out before slots do
+    int id = q->freeid;
+    q->freeid = q->idnext[id];
+    q->nfree -= nslot;
+    q->ndesc[id] = nslot;
+    q->tbls[id] = tbl;
+    record(q, id, bs, nbuf, op, nsect);
+
+    segs_t s = segsof(q, id, bs, nbuf, op);
+    uint16_t dataflgs = op == BLK_OP_R ? DESC_FLG_MSK_WRITE : 0;
+    uint64_t addr;
+    uint32_t len;
+    uint16_t head;
+    if (tbl) {
+        // NEXT is implied in an indirect table
+        int k = 0;
+        tbl[k++] = (pdesc_t){(uint64_t)&q->reqs[id], sizeof(req_t), 0, 0};
+        while (nextseg(&s, &addr, &len))
+            tbl[k++] = (pdesc_t){addr, len, 0, dataflgs};
+        tbl[k++] = (pdesc_t){(uint64_t)&q->status[id], 1, 0, DESC_FLG_MSK_WRITE};
+        head = pput(q, 0, (uint64_t)tbl, k * sizeof(pdesc_t), DESC_FLG_MSK_INDIRECT, id);
+    }
+    else {
+        int k = 0;
+        head = pput(q, k++, (uint64_t)&q->reqs[id], sizeof(req_t), DESC_FLG_MSK_NEXT, id);
+        while (nextseg(&s, &addr, &len))
+            pput(q, k++, addr, len, DESC_FLG_MSK_NEXT | dataflgs, id);
+        pput(q, k++, (uint64_t)&q->status[id], 1, DESC_FLG_MSK_WRITE, id);
+    }
 
-    reqs[idx1].op = w ? BLK_OP_W : BLK_OP_R;
-    reqs[idx1].sector = sect;
-    reqs[idx1].reserved = 0;
+    // the head last, once the rest of the chain is visible
+    sync();
+    q->ring[q->avail].flgs = head;
+    q->avail += nslot;
+    if (q->avail >= q->size) {
+        q->avail -= q->size;
+        q->availwrap = !q->availwrap;
+    }
+    sync();
 
-    desc_t* desc1 = &desctbl.arr[idx1];
-    desc_t* desc2 = &desctbl.arr[idx2];
-    desc_t* desc3 = &desctbl.arr[idx3];
+    // the device's event, its offset taken back by a ring size
+    // if it is on the lap before ours, as Linux does
+    uint16_t flgs = q->devevent->flgs;
+    if (flgs == PEVENT_ENABLE)
+        kick(q);
+    else if (flgs == PEVENT_DESC) {
+        uint16_t off_wrap = q->devevent->off_wrap;
+        uint16_t event = off_wrap & 0x7fff;
+        if ((off_wrap >> 15) != q->availwrap)
+            event -= q->size;
+        if (NEED_EVENT(event, q->avail, (uint16_t)(q->avail - nslot)))
+            kick(q);
+    }
+    return 1;
+}
 
-    desc1->addr = (uint64_t)&reqs[idx1];
-    desc1->len = sizeof(req_t);
-    desc1->flgs = DESC_FLG_MSK_NEXT;
-    desc1->next = idx2;
+// queue one disk read or write of as many of the n consecutive
+// blocks of bs as one request can carry, return how many, or
+// a flush, discard or write zeroes of nsect sectors with bs[0]
+// as the handle, returning 1; caller must hold q->lk
+static int submit_locked(vq_t *q, buf_t **bs, int n, int op, uint32_t nsect) {
+    int nseg = 0, nbuf = 1;
+    if (op == BLK_OP_R || op == BLK_OP_W) {
+        segs_t s = {bs, n, 0, 0, 0};
+        uint64_t addr;
+        uint32_t len;
+        while (nseg < seg_max && nextseg(&s, &addr, &len))
+            nseg++;
+        nbuf = s.i;
+    }
+    else if (op != BLK_OP_FLUSH)
+        nseg = 1; // the range
+
+    bool ok = q->packed ? submit_packed(q, bs, nbuf, nseg, op, nsect) :
+                          submit_split(q, bs, nbuf, nseg, op, nsect);
+    if (!ok)
+        return 0;
+    q->inflight++;
+    return nbuf;
+}
 
-    desc2->addr = (uint64_t)b->data;
-    desc2->len = BSIZE;
-    desc2->flgs = DESC_FLG_MSK_NEXT | (w ? 0 : DESC_FLG_MSK_WRITE);
-    desc2->next = idx3;
+static bool submit(buf_t *b, bool w) {
+    return submitv(&b, 1, w);
+}
 
-    desc3->addr = (uint64_t)&txns.status[idx1];
-    desc3->len = 1;
-    desc3->flgs = DESC_FLG_MSK_WRITE;
-    desc3->next = 0; // last in chain
+// on the submitting hart's own queue
+static int submitv(buf_t **bs, int n, bool w) {
+    return submitq(r_tp() % nvq, bs, n, w);
+}
 
-    // record the transation
-    txns.status[idx1] = 1;
-    b->disk = 1;
-    txns.bufs[idx1] = b;
+int submitq(int qi, buf_t **bs, int n, bool w) {
+    vq_t *q = &vqs[qi % nvq];
+    spinlk_acquire(&q->lk);
+    int done = submit_locked(q, bs, n, w ? BLK_OP_W : BLK_OP_R, 0);
+    spinlk_release(&q->lk);
+    return done;
+}
 
-    // write driver queue
-    driverq.ring[driverq.idx % NUMDESC] = idx1;
+int nqueues() {
+    return nvq;
+}
 
-    // update driver queue index
-    sync();
-    driverq.idx ++;
-    sync();
+bool can(int op) {
+    return op >= DISK_FLUSH && op <= DISK_ZERO && opmax[op];
+}
+
+uint32_t submitop(buf_t *b, int op, uint32_t n) {
+    static const int blkops[] = {BLK_OP_FLUSH, BLK_OP_DISCARD, BLK_OP_WRITE_ZEROES};
+    if (!can(op))
+        kpanic("disk: the device can't do that\n");
+    if (op == DISK_FLUSH)
+        n = 1;
+    else if (n > opmax[op])
+        n = opmax[op];
+
+    vq_t *q = &vqs[r_tp() % nvq];
+    spinlk_acquire(&q->lk);
+    int done = submit_locked(q, &b, 1, blkops[op], op == DISK_FLUSH ? 0 : n * (BSIZE / 512));
+    if (done)
+        opcount[op]++;
+    spinlk_release(&q->lk);
+    return done ? n : 0;
+}
 
-    *REG(MMIO_QUEUE_NOTIFY) = 0;
+static bool attach(buf_t *b, biodone_t done, void *arg) {
+    vq_t *q = &vqs[b->queue];
+    spinlk_acquire(&q->lk);
+    bool ok = b->disk && !b->done;
+    if (ok) {
+        b->done = done;
+        b->arg = arg;
+    }
+    spinlk_release(&q->lk);
+    return ok;
+}
+
+// disk read and write
+static void rw(buf_t* b, bool w) {
+    while (!submit(b, w)) {
+        // full, and if polled nobody else may be reaping it
+        poll();
+    }
 
     // wait for the disk finish the work
-    while(b->disk == 1) {
-        // sleep
+    wait(b);
+}
+
+// has the device completed a request q hasn't retired
+static bool pending(vq_t *q) {
+    if (q->packed) {
+        // used: AVAIL and USED both equal to the used wrap counter
+        uint16_t flgs = q->ring[q->used].flgs;
+        return !!(flgs & PDESC_FLG_MSK_AVAIL) == q->usedwrap &&
+               !!(flgs & PDESC_FLG_MSK_USED) == q->usedwrap;
     }
+    return q->idx != q->deviceq->idx;
+}
 
-    txns.bufs[idx1] = 0;
-    free3_desc(idx1);
+// take the next completed request off q, free its descriptors
+// and return its id, caller must hold q->lk
+static int takeused(vq_t *q) {
+    if (!q->packed) {
+        int id = q->deviceq->ring[q->idx % q->size].id;
+        free_chain(q, id);
+        q->idx++;
+        return id;
+    }
+    int id = q->ring[q->used].id;
+    q->used += q->ndesc[id];
+    if (q->used >= q->size) {
+        q->used -= q->size;
+        q->usedwrap = !q->usedwrap;
+    }
+    q->nfree += q->ndesc[id];
+    if (q->tbls[id]) {
+        kmem_cache_free(indcache, q->tbls[id]);
+        q->tbls[id] = 0;
+    }
+    q->idnext[id] = q->freeid;
+    q->freeid = id;
+    return id;
 }
 
-static void isr() {
-    spinlk_acquire(&lk);
+// Nothing left to retire on q: ask for an interrupt for what is
+// still in flight, or for none if polled. Returns whether
+// completions came in before the device could have seen it, as
+// no interrupt will come for those.
+static bool arm(vq_t *q) {
+    bool polled = mode != DISK_INTR && !q->sleepers;
+    if (q->packed) {
+        q->drvevent->flgs = polled ? PEVENT_DISABLE : PEVENT_ENABLE;
+        if (polled)
+            return 0;
+        sync();
+        return pending(q);
+    }
+    if (polled) {
+        // an event the used idx won't get past for 64K completions
+        if (eventidx)
+            USED_EVENT(q->driverq, q->size) = q->idx - 1;
+        else
+            q->driverq->flgs = AVAIL_FLG_MSK_NO_INTERRUPT;
+        return 0;
+    }
+    uint16_t event = q->idx;
+    if (eventidx) {
+        // interrupt when half of what is in flight is done
+        uint16_t half = (q->inflight + 1) / 2;
+        event = q->idx + (half ? half - 1 : 0);
+        USED_EVENT(q->driverq, q->size) = event;
+    }
+    else
+        q->driverq->flgs = 0;
+    sync();
+    // unless the device got there before it saw event
+    return (uint16_t)(q->deviceq->idx - q->idx) > (uint16_t)(event - q->idx);
+}
 
-    *REG(MMIO_INTR_ACK) = *REG(MMIO_INTR_STATUS) & 0x3;
+// Retire every request the device has completed on q: free its
+// descriptors, hand the buffer back (b->disk = 0) and run its
+// callback. The lock is dropped around a callback so that it
+// can start the next transfer. ready(q) runs last, so requests
+// held back for lack of room can go.
+static void reap(vq_t *q) {
+    int retired = 0;
+    spinlk_acquire(&q->lk);
 
     sync();
-    while (idx != deviceq.idx) {
+    for (;;) {
+        if (!pending(q)) {
+            if (arm(q))
+                continue;
+            break;
+        }
         sync();
-        int id = deviceq.ring[deviceq.idx % NUMDESC].id;
-        if (txns.status[id])
+        int id = takeused(q);
+        if (q->status[id])
             kpanic("incorrect status\n");
-        txns.bufs[id]->disk = 0;
-        // wakeup(inflight[id].b)
-        idx ++;
+        buf_t *b = q->bufs[id];
+        q->bufs[id] = 0;
+        q->inflight--;
+        q->reqs_done++;
+        retired++;
+        while (b) {
+            buf_t *next = b->rqnext;
+            biodone_t done = b->done;
+            void *arg = b->arg;
+            b->done = 0;
+            b->rqnext = 0;
+            sync();
+            b->disk = 0;
+            // wakeup(b)
+            if (done) {
+                spinlk_release(&q->lk);
+                done(b, arg);
+                spinlk_acquire(&q->lk);
+            }
+            b = next;
+        }
+    }
+
+    spinlk_release(&q->lk);
+    if (retired && ready)
+        ready(q->id);
+}
+
+// The device has one interrupt line for all of its queues, so
+// whichever hart takes it reaps every queue, its own first
+static void isr() {
+    *REG(MMIO_INTR_ACK) = *REG(MMIO_INTR_STATUS) & 0x3;
+
+    intrs++;
+    int self = r_tp() % nvq;
+    for (int i = 0; i < nvq; i++)
+        reap(&vqs[(self + i) % nvq]);
+}
+
+void stats() {
+    uint64_t reqs = 0, kicks = 0;
+    for (int i = 0; i < nvq; i++) {
+        kprintf("disk: queue %d: %d requests, %d kicks, %d in flight\n",
+                i, (int)vqs[i].reqs_done, (int)vqs[i].kicks, vqs[i].inflight);
+        reqs += vqs[i].reqs_done;
+        kicks += vqs[i].kicks;
     }
+    uint64_t n = reqs ? reqs : 1;
+    kprintf("disk: %d requests, %d kicks, %d interrupts (per 100 requests: %d kicks, %d interrupts)%s\n",
+            (int)reqs, (int)kicks, (int)intrs,
+            (int)(kicks * 100 / n), (int)(intrs * 100 / n),
+            eventidx ? ", event idx" : "");
+    kprintf("disk: %s ring%s\n", packed ? "packed" : "split", indcache ? ", indirect" : "");
+    kprintf("disk: %d flushes, %d discards, %d write zeroes, write cache %s\n",
+            (int)opcount[DISK_FLUSH], (int)opcount[DISK_DISCARD], (int)opcount[DISK_ZERO],
+            wcache ? "on" : "off");
+}
 
-    spinlk_release(&lk);
+void wait(buf_t *b) {
+    if (mode != DISK_INTR) {
+        // b->queue is only right once b is submitted, so it is
+        // read again every time around
+        uint64_t t0 = r_time();
+        while (b->disk && (mode == DISK_POLL || r_time() - t0 < spin_ticks))
+            reap(&vqs[b->queue]);
+        if (!b->disk || mode == DISK_POLL)
+            return;
+
+        // hybrid, done polling: turn the queue's interrupts on
+        // until b is done
+        vq_t *q = &vqs[b->queue];
+        spinlk_acquire(&q->lk);
+        q->sleepers++;
+        spinlk_release(&q->lk);
+        reap(q);
+        while (b->disk) {
+            // sleep
+        }
+        spinlk_acquire(&q->lk);
+        q->sleepers--;
+        spinlk_release(&q->lk);
+        return;
+    }
+    while (b->disk) {
+        // sleep
+    }
 }
 
+void poll() {
+    if (mode == DISK_INTR)
+        return;
+    for (int i = 0; i < nvq; i++)
+        if (vqs[i].inflight) // racy peek
+            reap(&vqs[i]);
+}
+
+void setmode(int m, int spin_us) {
+    spin_ticks = (uint64_t)spin_us * TIMEBASE_HZ / 1000000;
+    mode = m;
+    // turn interrupts on or off to match
+    for (int i = 0; i < nvq; i++)
+        reap(&vqs[i]);
+}
+
+int inflight(int q) {
+    if (q >= 0)
+        return vqs[q % nvq].inflight; // racy peek
+    int n = 0;
+    for (int i = 0; i < nvq; i++)
+        n += vqs[i].inflight;
+    return n;
+}
+
+void setready(void (*fn)(int q)) {
+    ready = fn;
+}
@@ -0,0 +1,345 @@
+#include "../include/iosched.h"
+#include "../include/disk.h"
+#include "../include/spinlk.h"
+#include "../include/kprintf.h"
+#include "../include/kpanic.h"
+#include "../include/hart.h"
+#include "../include/timer.h"
+
+/*
+    The I/O scheduler sits between the buffer cache and the
+    disk. bio queues every transfer here (iosched.submit), and
+    dispatch starts queued ones while the disk queue has fewer
+    than depth requests in flight. The rest wait, and the disk
+    calls dispatch again as its requests complete, so transfers
+    that pile up behind a busy disk get sorted and merged.
+
+    There is one scheduler queue per disk queue, each with its
+    own lock, and a hart queues on the one of its own disk queue
+    (disk.nqueues), so harts doing I/O at the same time share
+    neither a lock nor a ring, as with the disk alone. The price
+    is that each queue sorts and merges only its own harts'
+    transfers; with a single disk queue there is one scheduler
+    queue for every hart.
+
+    A queued buffer is on two lists of its queue: the arrival
+    list of its direction, oldest first, and one list of every
+    queued buffer in block order:
+
+    fifo[read]:  [9] -> [2] -> [7]
+    fifo[write]: [3]
+    sorted:      [2] -> [3] -> [7] -> [9]
+
+    New buffers go into the block order list from its tail, as
+    they mostly come in ascending runs. The policy picks the
+    buffer to start next:
+
+    noop      the older of the two arrival list heads
+    elevator  the first in block order at or after the block
+              where the last request ended (kept in cursor),
+              going around to the lowest block at the end (C-SCAN)
+    deadline  as elevator, but the oldest read or write first
+              once it has waited READ_EXPIRE or WRITE_EXPIRE
+
+    The request then takes in the queued buffers for the blocks
+    right before and after it in the same direction, up to
+    RANGE_MAX, and goes to the disk as one disk.submitq. noop only
+    looks at what follows it in arrival order, which still merges
+    a bread_range or a write-back batch queued at once.
+*/
+
+#define READ_EXPIRE (TIMEBASE_HZ / 2) // 500ms
+#define WRITE_EXPIRE (TIMEBASE_HZ * 5) // 5s
+
+static void init();
+static void submit(buf_t *b, bool w);
+static void submitv(buf_t **bs, int n, bool w);
+static void rw(buf_t *b, bool w);
+static void wait(buf_t *b);
+static bool attach(buf_t *b, biodone_t done, void *arg);
+static void dispatch();
+static void setpolicy(int policy);
+static void setdepth(int depth);
+static void stats();
+
+iosched_t iosched = {init, submit, submitv, rw, wait, attach, dispatch, setpolicy, setdepth, stats};
+
+// one per disk queue, hart h queues on sqs[h % nsq] and so
+// dispatches to its own disk queue
+typedef struct sq {
+    spinlk_t lk; // guards the rest
+    struct {
+        buf_t *head; // oldest
+        buf_t *tail;
+    } fifo[2];      // arrival order, by direction
+    buf_t *sorted;  // block order
+    buf_t *stail;
+    buf_t *cursor;  // first in block order at or after pos
+    int nqueued;
+    uint32_t pos;   // block after the last request
+    bool busy;      // a hart is dispatching
+    bool again;     // and has more to do since it started
+    buf_t *run[RANGE_MAX]; // the request being started
+    struct {
+        uint64_t reqs;    // disk requests started
+        uint64_t bufs;    // transfers they covered
+        uint64_t expired; // started out of block order for their age
+        uint64_t lat;     // ticks from queued to started, in total
+        uint64_t maxlat;
+    } st[3];        // by policy
+} __attribute__((aligned(64))) sq_t;
+
+static sq_t sqs[NCPU];
+static int nsq;
+static volatile int policy = IOSCHED_POLICY;
+static volatile int depth = IOSCHED_DEPTH;
+
+static char *names[] = {"noop", "deadline", "elevator"};
+
+static void dispatchq(int qi);
+
+void init() {
+    nsq = disk.nqueues();
+    disk.setready(dispatchq);
+}
+
+// caller must hold q->lk
+static void enqueue(sq_t *q, int qi, buf_t *b, bool w) {
+    b->disk = 1;
+    b->sched = 1;
+    b->w = w;
+    b->queued = r_time();
+    b->queue = qi;
+
+    b->qnext = 0;
+    b->qprev = q->fifo[w].tail;
+    if (q->fifo[w].tail)
+        q->fifo[w].tail->qnext = b;
+    else
+        q->fifo[w].head = b;
+    q->fifo[w].tail = b;
+
+    // from the tail, as blocks mostly come in ascending runs
+    buf_t *prev = q->stail, *next = 0;
+    for (; prev && prev->blockno > b->blockno; prev = prev->sprev)
+        next = prev;
+    b->sprev = prev;
+    b->snext = next;
+    if (prev)
+        prev->snext = b;
+    else
+        q->sorted = b;
+    if (next)
+        next->sprev = b;
+    else
+        q->stail = b;
+    if (b->blockno >= q->pos && (!q->cursor || b->blockno < q->cursor->blockno))
+        q->cursor = b;
+    q->nqueued++;
+}
+
+// caller must hold q->lk
+static void dequeue(sq_t *q, buf_t *b) {
+    if (b->qprev)
+        b->qprev->qnext = b->qnext;
+    else
+        q->fifo[b->w].head = b->qnext;
+    if (b->qnext)
+        b->qnext->qprev = b->qprev;
+    else
+        q->fifo[b->w].tail = b->qprev;
+
+    if (b->sprev)
+        b->sprev->snext = b->snext;
+    else
+        q->sorted = b->snext;
+    if (b->snext)
+        b->snext->sprev = b->sprev;
+    else
+        q->stail = b->sprev;
+    if (q->cursor == b)
+        q->cursor = b->snext;
+
+    b->qprev = b->qnext = b->sprev = b->snext = 0;
+    b->sched = 0;
+    q->nqueued--;
+}
+
+// The buffer to start next, caller must hold q->lk. Sets
+// *expired if it was picked out of block order for its age
+static buf_t *pick(sq_t *q, int p, bool *expired) {
+    *expired = 0;
+    if (p == IOSCHED_NOOP) {
+        buf_t *r = q->fifo[0].head, *w = q->fifo[1].head;
+        return !r || (w && w->queued < r->queued) ? w : r;
+    }
+    if (p == IOSCHED_DEADLINE) {
+        uint64_t now = r_time();
+        for (int w = 0; w < 2; w++) {
+            buf_t *b = q->fifo[w].head;
+            if (b && now - b->queued > (w ? WRITE_EXPIRE : READ_EXPIRE)) {
+                *expired = 1;
+                return b;
+            }
+        }
+    }
+    return q->cursor ? q->cursor : q->sorted;
+}
+
+// Fill q->run with b and the queued buffers it merges with, in
+// block order, and return how many, caller must hold q->lk
+static int gather(sq_t *q, int p, buf_t *b) {
+    bool w = b->w;
+    if (p != IOSCHED_NOOP)
+        for (int i = 1; i < RANGE_MAX && b->sprev && b->sprev->w == w &&
+                        b->sprev->blockno + 1 == b->blockno; i++)
+            b = b->sprev;
+    int n = 0;
+    q->run[n++] = b;
+    while (n < RANGE_MAX) {
+        buf_t *next = p == IOSCHED_NOOP ? b->qnext : b->snext;
+        if (!next || next->w != w || next->blockno != b->blockno + 1)
+            break;
+        q->run[n++] = b = next;
+    }
+    return n;
+}
+
+// Start transfers queued on sqs[qi] while its disk queue takes
+// them. Only one hart at a time does; others calling meanwhile
+// leave it to go around again. q->lk is held across
+// disk.submitq so that attach finds a buffer either queued here
+// or at the disk.
+static void dispatchq(int qi) {
+    sq_t *q = &sqs[qi];
+    spinlk_acquire(&q->lk);
+    if (q->busy) {
+        q->again = 1;
+        spinlk_release(&q->lk);
+        return;
+    }
+    q->busy = 1;
+    do {
+        q->again = 0;
+        while (q->nqueued && (!depth || disk.inflight(qi) < depth)) {
+            int p = policy;
+            bool expired;
+            int n = gather(q, p, pick(q, p, &expired));
+            uint32_t start = q->run[0]->blockno;
+            int k = disk.submitq(qi, q->run, n, q->run[0]->w);
+            if (!k)
+                break; // full
+            buf_t *after = q->run[k - 1]->snext;
+            uint64_t now = r_time();
+            for (int i = 0; i < k; i++) {
+                uint64_t lat = now - q->run[i]->queued;
+                q->st[p].lat += lat;
+                if (lat > q->st[p].maxlat)
+                    q->st[p].maxlat = lat;
+                dequeue(q, q->run[i]);
+            }
+            q->st[p].reqs++;
+            q->st[p].bufs += k;
+            q->st[p].expired += expired;
+            q->pos = start + k;
+            q->cursor = after;
+        }
+        if (q->nqueued) {
+            // the disk is busy; if polled, reap it, which calls
+            // dispatchq back, and so sets again, if any completed
+            spinlk_release(&q->lk);
+            disk.poll();
+            spinlk_acquire(&q->lk);
+        }
+    } while (q->again);
+    q->busy = 0;
+    spinlk_release(&q->lk);
+}
+
+void dispatch() {
+    for (int i = 0; i < nsq; i++)
+        dispatchq(i);
+}
+
+void submit(buf_t *b, bool w) {
+    submitv(&b, 1, w);
+}
+
+void submitv(buf_t **bs, int n, bool w) {
+    int qi = r_tp() % nsq;
+    sq_t *q = &sqs[qi];
+    spinlk_acquire(&q->lk);
+    for (int i = 0; i < n; i++)
+        enqueue(q, qi, bs[i], w);
+    spinlk_release(&q->lk);
+    dispatchq(qi);
+}
+
+void rw(buf_t *b, bool w) {
+    submit(b, w);
+    wait(b);
+}
+
+void wait(buf_t *b) {
+    // started once requests ahead of it complete, which under
+    // polling takes someone reaping them
+    while (b->sched)
+        disk.poll();
+    disk.wait(b);
+}
+
+bool attach(buf_t *b, biodone_t done, void *arg) {
+    // b->queue only changes when b is queued again, which its
+    // holder does not do with a transfer still pending
+    sq_t *q = &sqs[b->queue % nsq];
+    spinlk_acquire(&q->lk);
+    if (b->sched) {
+        bool ok = !b->done;
+        if (ok) {
+            b->done = done;
+            b->arg = arg;
+        }
+        spinlk_release(&q->lk);
+        return ok;
+    }
+    spinlk_release(&q->lk);
+    return disk.attach(b, done, arg);
+}
+
+void setpolicy(int p) {
+    if (p < IOSCHED_NOOP || p > IOSCHED_ELEVATOR)
+        kpanic("iosched: no such policy\n");
+    policy = p;
+    dispatch();
+}
+
+void setdepth(int d) {
+    depth = d < 0 ? 0 : d;
+    dispatch();
+}
+
+void stats() {
+    int nqueued = 0;
+    for (int i = 0; i < nsq; i++)
+        nqueued += sqs[i].nqueued; // racy peek
+    for (int p = 0; p < 3; p++) {
+        uint64_t reqs = 0, bufs = 0, expired = 0, lat = 0, maxlat = 0;
+        for (int i = 0; i < nsq; i++) {
+            reqs += sqs[i].st[p].reqs;
+            bufs += sqs[i].st[p].bufs;
+            expired += sqs[i].st[p].expired;
+            lat += sqs[i].st[p].lat;
+            if (sqs[i].st[p].maxlat > maxlat)
+                maxlat = sqs[i].st[p].maxlat;
+        }
+        if (!bufs)
+            continue;
+        kprintf("iosched: %s: %d requests for %d transfers (%d merged), %d expired, "
+                "dispatch latency avg %d us, max %d us\n",
+                names[p], (int)reqs, (int)bufs, (int)(bufs - reqs),
+                (int)expired, (int)(lat / bufs * 1000000 / TIMEBASE_HZ),
+                (int)(maxlat * 1000000 / TIMEBASE_HZ));
+    }
+    kprintf("iosched: %s, depth %d per queue, %d queues, %d queued\n",
+            names[policy], depth, nsq, nqueued);
+}
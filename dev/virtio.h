@@ -104,10 +104,12 @@
 #define MMIO_DEVICE_ID            0x008
 #define MMIO_VENDOR_ID            0x00c
 #define MMIO_DEVICE_FEATURES      0x010
+#define MMIO_DEVICE_FEATURES_SEL  0x014 // which 32 feature bits MMIO_DEVICE_FEATURES shows
 #define MMIO_DRIVER_FEATURES      0x020
+#define MMIO_DRIVER_FEATURES_SEL  0x024
 #define MMIO_QUEUE_SEL            0x030 
 #define MMIO_QUEUE_SIZE_MAX       0x034 // renamed from QueueNumMax
-#define MMIO_QUEUE_SIZE           0x038 // renamed from QueueNum
+#define MMIO_QUEUE_SIZE           0x038 // renamed from QueueNum, set by the driver
 #define MMIO_QUEUE_READY          0x044
 #define MMIO_QUEUE_NOTIFY         0x050
 #define MMIO_INTR_STATUS          0x060
@@ -119,6 +121,17 @@
 #define MMIO_DRIVER_QUEUE_HIGH    0x094
 #define MMIO_DEVICE_QUEUE_LOW     0x0a0 // renamed from QueueDeviceLow
 #define MMIO_DEVICE_QUEUE_HIGH    0x0a4
+#define MMIO_CONFIG               0x100 // device specific configuration space
+
+// Block Device Configuration Layout, section 5.2.4
+// offsets into the configuration space
+#define BLK_CONFIG_CAPACITY       0x00 // 64-bit, in 512-byte sectors
+#define BLK_CONFIG_SIZE_MAX       0x08 // largest data segment in bytes, with BLK_FEATURE_BIT_SIZE_MAX
+#define BLK_CONFIG_SEG_MAX        0x0c // most data segments in a request, with BLK_FEATURE_BIT_SEG_MAX
+#define BLK_CONFIG_WRITEBACK      0x20 // 8-bit, 1: write cache on, writable with BLK_FEATURE_BIT_CONFIG_WCE
+#define BLK_CONFIG_NUM_QUEUES     0x22 // 16-bit, with BLK_FEATURE_BIT_MQ
+#define BLK_CONFIG_MAX_DISCARD_SECTORS 0x24 // largest discard, with BLK_FEATURE_BIT_DISCARD
+#define BLK_CONFIG_MAX_WZEROES_SECTORS 0x30 // largest write zeroes, with BLK_FEATURE_BIT_WRITE_ZEROES
 
 // Device Status Field
 // For more details, see section 2.1 in sepc
@@ -131,15 +144,23 @@
 // Block Device Feature Bits
 // Refer to section 4.2 for more details about block device fearure bits
 // and section 2.2 about feature bits in general
+#define BLK_FEATURE_BIT_SIZE_MAX        1
+#define BLK_FEATURE_BIT_SEG_MAX         2
 #define BLK_FEATURE_BIT_RO              5
 #define BLK_FEATURE_BIT_SCSI            7
+#define BLK_FEATURE_BIT_FLUSH           9
 #define BLK_FEATURE_BIT_CONFIG_WCE      11
 #define BLK_FEATURE_BIT_MQ              12
+#define BLK_FEATURE_BIT_DISCARD         13
+#define BLK_FEATURE_BIT_WRITE_ZEROES    14
 #define QUEUE_FEATURE_BIT_ANY_LAYOUT    27
 #define QUEUE_FEATURE_BIT_INDIRECT_DESC 28
 #define QUEUE_FEATURE_BIT_EVENT_IDX     29
+// in the second 32 feature bits, section 6
+#define FEATURE_BIT_VERSION_1           (32 - 32)
+#define QUEUE_FEATURE_BIT_RING_PACKED   (34 - 32)
 
-#define NUMDESC 8 // number of descriptors in the table
+#define QSIZE_MAX 1024 // queue size the driver asks for at most
 
 #define DESC_FLG_MSK_NEXT     0x1
 #define DESC_FLG_MSK_WRITE    0x2
@@ -153,30 +174,73 @@ typedef struct desc {
     uint16_t next;
 } __attribute__((packed, aligned(16))) desc_t;
 
+#define AVAIL_FLG_MSK_NO_INTERRUPT 0x1 // without EVENT_IDX, don't interrupt on completions
+
 // The Virtqueue Available Ring, section 2.4.6
+// ring has as many entries as the queue has descriptors
 typedef struct driverq {
   uint16_t flgs;
   uint16_t idx; // driver-updated
-  uint16_t ring[NUMDESC];
-  uint16_t dontcare;
+  uint16_t ring[];
 } __attribute__((packed, aligned(16))) driverq_t;
 
 // The Virtqueue Used Ring, section 2.4.8
 typedef struct deviceq {
   uint16_t flgs;
   uint16_t idx; // device-updated (this is try to keep up with the driver queue)
-  struct { uint32_t id, len; } ring [NUMDESC];
-  uint16_t dontcare;
+  struct { uint32_t id, len; } ring [];
 } __attribute__((packed, aligned(16))) deviceq_t;
 
+// With QUEUE_FEATURE_BIT_EVENT_IDX, section 2.7.7/2.7.10: the
+// driver asks for an interrupt once the device's used idx moves
+// past used_event, which follows the driver queue's ring, and the
+// device asks for a notification once the driver queue's idx moves
+// past avail_event, which follows the device queue's ring.
+#define USED_EVENT(dq, size) (*(volatile uint16_t *)&(dq)->ring[size])
+#define AVAIL_EVENT(uq, size) (*(volatile uint16_t *)&(uq)->ring[size])
+// did moving an index from old to new go past event?
+#define NEED_EVENT(event, new, old) ((uint16_t)((new) - (event) - 1) < (uint16_t)((new) - (old)))
+
+// Packed Virtqueues, section 2.8: one ring of descriptors the
+// driver makes available and the device marks used in place
+#define PDESC_FLG_MSK_AVAIL (1 << 7)
+#define PDESC_FLG_MSK_USED  (1 << 15)
+
+typedef struct pdesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;   // buffer id, returned by the device when used
+    uint16_t flgs; // DESC_FLG_MSK_* and PDESC_FLG_MSK_*
+} __attribute__((packed, aligned(16))) pdesc_t;
+
+// Event Suppression Structure, section 2.8.10, one written by
+// the driver and one by the device
+#define PEVENT_ENABLE  0 // notify on every buffer
+#define PEVENT_DISABLE 1 // don't notify
+#define PEVENT_DESC    2 // notify when off_wrap is reached, with EVENT_IDX
+typedef struct pevent {
+    uint16_t off_wrap; // ring offset, wrap counter in bit 15
+    uint16_t flgs;
+} __attribute__((packed, aligned(4))) pevent_t;
+
 #define BLK_OP_R 0 // read the disk
 #define BLK_OP_W 1 // write the disk
+#define BLK_OP_FLUSH 4 // write the device's cache out, no data
+#define BLK_OP_DISCARD 11 // sectors may be dropped, data is a range_t
+#define BLK_OP_WRITE_ZEROES 13 // sectors read back as zeroes, data is a range_t
 // Device Operation, section 5.2.6
 typedef struct req {
-  uint32_t op; // read or write
+  uint32_t op; // BLK_OP_*
   uint32_t reserved;
-  uint64_t sector;
+  uint64_t sector; // 0 for BLK_OP_FLUSH
 } req_t;
 
+// the data of BLK_OP_DISCARD and BLK_OP_WRITE_ZEROES
+typedef struct range {
+  uint64_t sector;
+  uint32_t nsect;
+  uint32_t flgs; // bit 0: unmap, write zeroes may deallocate
+} range_t;
+
 #endif
 
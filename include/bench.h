@@ -0,0 +1,24 @@
+#ifndef _bench_h_
+#define _bench_h_
+
+#include "types.h"
+#include "timer.h"
+
+// Benchmarks are built into the kernel with `make run BENCH=name`,
+// which has every hart call bench_name() once the kernel is up.
+// CPUS is the number of harts qemu was started with.
+#ifndef CPUS
+#define CPUS 1
+#endif
+
+// Block until all CPUS harts have called it
+void bench_barrier(void);
+
+// Next pseudo-random number from *seed, which it advances; a
+// seed gives the same sequence in every benchmark
+uint32_t bench_rand(uint64_t *seed);
+
+// time CSR ticks to microseconds
+#define TICKS_TO_US(t) ((t) * 1000000 / TIMEBASE_HZ)
+
+#endif
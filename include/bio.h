@@ -4,25 +4,91 @@
 #include "../include/types.h"
 
 #define BSIZE 1024
+#define RANGE_MAX 64 // blocks in one bread_range
+
+// buffer replacement policies, make BIOPOLICY=LRU|2Q picks one
+#define BIO_LRU 0
+#define BIO_2Q 1
+#ifndef BIO_POLICY
+#define BIO_POLICY BIO_2Q
+#endif
 
 typedef struct buf buf_t;
+
+// Completion callback of an asynchronous transfer, called from
+// the disk interrupt with no lock held
+typedef void (*biodone_t)(buf_t *b, void *arg);
+
 struct buf {
   bool valid;   // has data been read from disk?
-  bool disk;    // does disk "own" buf?
+  volatile bool disk; // does disk "own" buf?
+  bool ra;      // read ahead and not used yet
+  bool dirty;   // modified in memory, not written to disk yet
+  bool hot;     // 2Q: referenced again after being evicted once
+  uint64_t dirtied; // time it became dirty
   uint32_t dev;
   uint32_t blockno;
   // sleep lock
   uint32_t refct;
-  buf_t *prev;
+  buf_t *prev;  // free list, only while refct == 0
   buf_t *next;
-  char data[1024];
+  buf_t *hnext; // hash chain
+  buf_t **hpprev; // link pointing at this buf in the hash chain, 0 if unhashed
+  buf_t *dprev; // dirty list, only while dirty
+  buf_t *dnext;
+  buf_t *rqnext; // next buffer in the same disk request
+  uint16_t queue; // disk queue the request is on
+  biodone_t done; // called when the transfer in flight completes, may be 0
+  void *arg;
+  // I/O scheduler queues, only while sched
+  volatile bool sched; // queued, not started on the disk yet
+  bool w;       // queued for a write
+  uint64_t queued; // time it was queued
+  buf_t *qprev; // arrival order
+  buf_t *qnext;
+  buf_t *sprev; // block order
+  buf_t *snext;
+  char *data;   // BSIZE bytes
 };
 
 typedef struct bio{
     void (*init)(void);
     buf_t* (*bread)(uint32_t dev, uint32_t blockno);
+    // Read n consecutive blocks into bs[0..n-1], referenced, with
+    // as few disk requests as the device allows. n <= RANGE_MAX
+    void (*bread_range)(uint32_t dev, uint32_t start, int n, buf_t **bs);
+    // With WRITEBACK, marks the buffer dirty for a later write-back;
+    // without, returns once the disk has it, which may be in its
+    // write cache. bio.sync and then bio.flush make it durable
     void (*write)(buf_t*);
     void (*brelease)(buf_t*);
+    // Start a read or write and return without waiting for it.
+    // done(b, arg) is called once the transfer completes, or
+    // before returning if there is nothing to read. bread_async
+    // returns the referenced buffer; its data may be used only
+    // after done is called or wait returns.
+    buf_t* (*bread_async)(uint32_t dev, uint32_t blockno, biodone_t done, void *arg);
+    void (*write_async)(buf_t*, biodone_t done, void *arg);
+    void (*wait)(buf_t*); // returns when no transfer of the buffer is in flight
+    // add n buffers to the cache, or drop up to n unreferenced ones,
+    // return how many were actually added or dropped
+    int (*grow)(int n);
+    int (*shrink)(int n);
+    void (*stats)(void); // print per-shard hit/miss counters
+    void (*counters)(uint64_t *hits, uint64_t *misses); // totals over every shard
+    void (*setra)(int max); // largest read-ahead window in blocks, 0 turns it off
+    // Write every dirty block of dev, returns when the disk has
+    // them, which may be in its write cache (see flush)
+    void (*sync)(uint32_t dev);
+    void (*flush_idle)(void);   // called by idle harts to write back old dirty blocks
+    // Tell the disk n blocks from start are unused: their data
+    // may be dropped, and reads may return it or zeroes
+    void (*discard)(uint32_t dev, uint32_t start, uint32_t n);
+    void (*zero_range)(uint32_t dev, uint32_t start, uint32_t n); // n blocks from start read back as zeroes
+    // Have the disk flush its write cache, returns when every write
+    // to dev it has completed is durable; writes nothing back, so
+    // callers that need their dirty blocks durable sync first
+    void (*flush)(uint32_t dev);
 } bio_t;
 
 extern bio_t bio;
@@ -3,10 +3,58 @@
 
 #include "bio.h"
 
+// How a hart waiting on a transfer learns that it is done
+#define DISK_INTR 0   // from the interrupt
+#define DISK_POLL 1   // by reaping the queue itself, no interrupts
+#define DISK_HYBRID 2 // by reaping for a while, then from the interrupt
+
+// Requests that move no data, disk.submitop
+#define DISK_FLUSH 0   // make completed writes durable
+#define DISK_DISCARD 1 // the blocks' data may be dropped
+#define DISK_ZERO 2    // the blocks read back as zeroes
+
 typedef struct disk {
     void (*init)(void);
-    void (*rw)(buf_t *b, bool w);
+    void (*rw)(buf_t *b, bool w); // returns when the transfer is done
     void (*isr)(void);
+    // Start a transfer and return without waiting for it,
+    // b->disk is cleared once it is done, then b->done is
+    // called if set. Returns 0 if the queue is full and
+    // nothing was started; nothing is reaped to make room
+    bool (*submit)(buf_t *b, bool w);
+    // Start one request for the n consecutive blocks of bs, or as
+    // many of them as fit in one. Returns how many it covers, 0
+    // if the queue is full
+    int (*submitv)(buf_t **bs, int n, bool w);
+    // Have done(b, arg) called when the transfer of b in flight
+    // completes. Returns 0 if none is, or one already has a
+    // callback
+    bool (*attach)(buf_t *b, biodone_t done, void *arg);
+    uint32_t (*nblocks)(void); // disk size in BSIZE blocks
+    void (*stats)(void); // print request, notification and interrupt counts
+    void (*wait)(buf_t *b); // returns when b has no transfer in flight
+    // Reap completions of every queue unless in DISK_INTR mode,
+    // where the interrupt does it. Idle harts call it.
+    void (*poll)(void);
+    // DISK_INTR, DISK_POLL or DISK_HYBRID, spin_us is how long a
+    // DISK_HYBRID waiter polls before waiting for the interrupt
+    void (*setmode)(int mode, int spin_us);
+    // requests started and not completed on queue q, or over
+    // every queue if q < 0
+    int (*inflight)(int q);
+    // Have ready(q) called, with no lock held, after requests on
+    // queue q complete, so that whoever holds back requests can
+    // start more
+    void (*setready)(void (*ready)(int q));
+    bool (*can)(int op); // does the device do DISK_FLUSH, DISK_DISCARD or DISK_ZERO
+    // Start a request moving no data with b as its handle, b->disk
+    // and b->done working as with submit. DISK_DISCARD and
+    // DISK_ZERO cover n blocks from b->blockno, or as many as the
+    // device takes in one; returns how many, 1 for DISK_FLUSH, 0
+    // if the queue is full
+    uint32_t (*submitop)(buf_t *b, int op, uint32_t n);
+    int (*nqueues)(void); // request queues, hart h submits to h % nqueues
+    int (*submitq)(int q, buf_t **bs, int n, bool w); // submitv on queue q
 } disk_t;
 
 
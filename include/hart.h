@@ -3,6 +3,8 @@
 
 #include "types.h"
 
+#define NCPU 8 // maximum number of harts supported
+
 #define FUNC_READ_CSR(register_name) \
 static inline uint64_t \
 r_##register_name() { \
@@ -46,6 +48,11 @@ FUNC_READ_CSR(scause)
 FUNC_READ_CSR(sie)
 FUNC_READ_CSR(sstatus)
 FUNC_READ_CSR(stvec)
+FUNC_READ_CSR(stval)
+FUNC_READ_CSR(sepc)
+FUNC_READ_CSR(mcounteren)
+FUNC_READ_CSR(time)
+FUNC_READ_CSR(cycle)
 
 FUNC_WRITE_CSR(mscratch)
 FUNC_WRITE_CSR(mtvec)
@@ -61,6 +68,7 @@ FUNC_WRITE_CSR(scause)
 FUNC_WRITE_CSR(sie)
 FUNC_WRITE_CSR(sstatus)
 FUNC_WRITE_CSR(stvec)
+FUNC_WRITE_CSR(mcounteren)
 
 FUNC_READ_GP(tp)
 FUNC_READ_GP(sp)
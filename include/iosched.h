@@ -0,0 +1,43 @@
+#ifndef _iosched_h_
+#define _iosched_h_
+
+#include "bio.h"
+
+// I/O scheduling policies, make IOSCHED=NOOP|DEADLINE|ELEVATOR
+// picks the one at boot, iosched.setpolicy another later
+#define IOSCHED_NOOP 0     // arrival order
+#define IOSCHED_DEADLINE 1 // block order, unless a request waited too long
+#define IOSCHED_ELEVATOR 2 // block order, one way sweeps
+#ifndef IOSCHED_POLICY
+#define IOSCHED_POLICY IOSCHED_ELEVATOR
+#endif
+#ifndef IOSCHED_DEPTH
+#define IOSCHED_DEPTH 32 // requests in flight per disk queue, iosched.setdepth
+#endif
+
+typedef struct iosched {
+    void (*init)(void); // after disk.init
+    // Queue a transfer of b and return without waiting for it.
+    // b->disk is set now and cleared once the transfer is done,
+    // then b->done is called if set, as with disk.submit, but
+    // the queue is never full
+    void (*submit)(buf_t *b, bool w);
+    void (*submitv)(buf_t **bs, int n, bool w); // n transfers at once
+    void (*rw)(buf_t *b, bool w); // returns when the transfer is done
+    void (*wait)(buf_t *b); // returns when b has no transfer queued or in flight
+    // Have done(b, arg) called when the transfer of b queued or
+    // in flight completes. Returns 0 if none is, or one already
+    // has a callback
+    bool (*attach)(buf_t *b, biodone_t done, void *arg);
+    // Start queued transfers while their disk queue has fewer than
+    // depth requests in flight; the disk calls it for a queue when
+    // requests on it complete
+    void (*dispatch)(void);
+    void (*setpolicy)(int policy);
+    void (*setdepth)(int depth); // per disk queue, 0: as many as it takes
+    void (*stats)(void); // print merges and dispatch latency per policy
+} iosched_t;
+
+extern iosched_t iosched;
+
+#endif
@@ -5,11 +5,20 @@
 
 typedef uint64_t pa_t;  // pa: physical address
 
+#define PGSIZE 4096
+#define MAXORDER 10 // largest contiguous allocation is 2^MAXORDER pages (4M)
+
 // Physical memory manager interface
 struct pmmngr{
     void (*init)(void);
-    pa_t (*alloc)(void);
-    void (*free)(pa_t);
+    pa_t (*alloc)(void); // same as alloc_pages(0)
+    void (*free)(pa_t);  // same as free_pages(pa, 0)
+    pa_t (*alloc_pages)(int order); // 2^order contiguous pages, aligned to their size
+    void (*free_pages)(pa_t, int order);
+    pa_t (*alloc_zeroed)(void); // a page filled with zeros
+    bool (*zero_idle)(void); // called by idle harts to refill the pre-zeroed pool, 0 if it is full
+    uint64_t (*npages)(void); // number of pages managed, free or not
+    void (*stats)(void); // print per-hart magazine counters and free blocks
 };
 
 typedef struct pmmngr pmmngr_t;
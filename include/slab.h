@@ -0,0 +1,23 @@
+#ifndef _slab_h_
+#define _slab_h_
+
+#include "types.h"
+
+// Object caches for fixed-size kernel objects, built on pmmngr pages
+typedef struct kmem_cache kmem_cache_t;
+
+// Create a cache of objects of size bytes each aligned to align
+// (a power of two up to PGSIZE, 0 for 8), returns 0 if no cache
+// can be created
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align);
+
+// Return an object from c, or 0 if out of memory
+void *kmem_cache_alloc(kmem_cache_t *c);
+
+// Give obj back to the cache it was allocated from
+void kmem_cache_free(kmem_cache_t *c, void *obj);
+
+// Print usage of every cache
+void kmem_cache_stats(void);
+
+#endif
@@ -13,11 +13,18 @@ typedef struct spinlk spinlk_t;
 void spinlk_init(spinlk_t *lk);
 
 // BLOCK (spin) until lk is =acquired
-// Return if lk is acquired
+// Return if lk is acquired, with interrupts off until released
 void spinlk_acquire(spinlk_t *lk);
 
 // Release the lock
 void spinlk_release(spinlk_t *lk);
 
+// Disable supervisor interrupts on the calling hart
+// Calls nest, and interrupts are only turned back on
+// by the pop_off matching the outermost push_off, and
+// only if they were on before that push_off
+void push_off(void);
+void pop_off(void);
+
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef _timer_h_
 #define _timer_h_
 
+#define TIMEBASE_HZ 10000000 // rate of the time CSR (mtime) on qemu virt
+
 void timer_init();
 
 #endif
@@ -2,19 +2,60 @@
 #define _vm_h_
 
 #include "types.h"
+#include "pm.h"
 
 enum pte_flgs {
     PTE_R = 0x2,
     PTE_W = 0x4,
-    PTE_X = 0x8
+    PTE_X = 0x8,
+    PTE_G = 0x20  // global, in every address space (kernel mappings)
 };
 
 typedef uint64_t va_t;
 
 typedef struct vmmngr {
     void (*init)(void);
+    void (*inithart)(void); // install the kernel page table on the calling hart
+    // Map [pa, pa + len) at va in the kernel page table with the largest
+    // pages alignment allows, 0 on success. va, pa, len must be 4K aligned
+    int (*map_range)(va_t va, pa_t pa, size_t len, int flags);
+    // Remove or change the permissions of whatever is mapped in [va, va + len)
+    // superpages partly in the range are split first
+    void (*unmap_range)(va_t va, size_t len);
+    void (*protect_range)(va_t va, size_t len, int flags);
+    // Reserve len bytes of kernel address space that is backed by zeroed
+    // pages on first touch, 0 if there is no room left
+    va_t (*reserve)(size_t len, int flags);
+    // Page fault handler, returns 0 if va is not in a reserved region
+    // or the access (scause 12, 13 or 15) is not allowed there
+    bool (*fault)(va_t va, int cause);
 } vmmngr_t;
 
 extern vmmngr_t vmmngr;
 
+/*
+    An address space of its own: the kernel mappings, shared,
+    plus whatever is mapped in it with vmspace_map, which must
+    not overlap the kernel's. Each one is tagged with a RISC-V
+    ASID, so switching between them keeps the TLB.
+*/
+typedef struct vmspace {
+    struct pt *pt;   // root page table
+    uint64_t asid;   // only valid while gen is current
+    uint64_t gen;    // ASID generation asid was allocated in
+} vmspace_t;
+
+// 0 on success, -1 if out of memory
+int vmspace_init(vmspace_t *vs);
+
+// Free the page tables (not the mapped pages) of vs
+void vmspace_destroy(vmspace_t *vs);
+
+// Run the calling hart in vs, 0 for the kernel page table
+void vmspace_switch(vmspace_t *vs);
+
+int vmspace_map(vmspace_t *vs, va_t va, pa_t pa, size_t len, int flags);
+void vmspace_unmap(vmspace_t *vs, va_t va, size_t len);
+void vmspace_protect(vmspace_t *vs, va_t va, size_t len, int flags);
+
 #endif
@@ -3,6 +3,11 @@
 #include "../include/uart.h"
 #include "../include/types.h"
 #include "../include/kprintf.h"
+#include "../include/pm.h"
+#include "../include/slab.h"
+#include "../include/bio.h"
+#include "../include/disk.h"
+#include "../include/iosched.h"
 
 #define LINESIZE 16
 static char line[LINESIZE];
@@ -36,6 +41,11 @@ void isr(char c) {
     {
         case Ctrl('P'):
             kprintf("procdump\n");
+            pmmngr.stats();
+            kmem_cache_stats();
+            bio.stats();
+            disk.stats();
+            iosched.stats();
             break;
         
         case Ctrl('U'):
@@ -6,14 +6,31 @@
 #include "../include/plic.h"
 #include "../include/disk.h"
 #include "../include/bio.h"
+#include "../include/iosched.h"
+#include "../include/timer.h"
+#include "../include/sync.h"
 
 void _strap_stub();
 
+// set by hart 0 once the physical memory manager is up
+static volatile bool started = 0;
+// set by hart 0 once everything is up
+static volatile bool booted = 0;
+
+#ifdef BENCH
+void BENCH(void);
+#endif
+
 void main () {
     if (!r_tp()) {
         uart.init();
         kprintf("booting...");
+        uint64_t t0 = r_time();
         pmmngr.init();
+        uint64_t t1 = r_time();
+        // other harts may start pre-zeroing pages now
+        sync();
+        started = 1;
         w_stvec((uint64_t)_strap_stub);
         vmmngr.init();
         plic.init();
@@ -22,11 +39,41 @@ void main () {
         w_sstatus(r_sstatus()|1<<1);
         w_sie(r_sie()|1<<9);
         disk.init();
+        iosched.init();
         bio.init();
+        // boot time, from the first line of main
+        kprintf("done in %d us (pmmngr.init %d us)\n",
+                (int)((r_time() - t0) * 1000000 / TIMEBASE_HZ),
+                (int)((t1 - t0) * 1000000 / TIMEBASE_HZ));
+        sync();
+        booted = 1;
         buf_t *b = bio.bread(0,0);
         asm("de:");
         b->data[1] = 2;
         bio.write(b);
     }
-    for(;;);
+    else {
+        while (!started)
+            ;
+        sync();
+        // pre-zero pages while hart 0 finishes booting
+        while (!booted)
+            pmmngr.zero_idle();
+        sync();
+        w_stvec((uint64_t)_strap_stub);
+        vmmngr.inithart();
+        // take device interrupts too, the disk has a queue per hart
+        plic.inithart();
+        w_sstatus(r_sstatus()|1<<1);
+        w_sie(r_sie()|1<<9);
+    }
+#ifdef BENCH
+    BENCH();
+#endif
+    // idle
+    for(;;) {
+        pmmngr.zero_idle();
+        bio.flush_idle();
+        disk.poll();
+    }
 }
@@ -1,6 +1,8 @@
 #include "../include/pm.h"
 #include "../include/util.h"
 #include "../include/spinlk.h"
+#include "../include/hart.h"
+#include "../include/kprintf.h"
 
 /*
     DRAM layout:
@@ -26,66 +28,363 @@
 static void init();
 static pa_t alloc();
 static void free(pa_t);
+static pa_t alloc_pages(int);
+static void free_pages(pa_t, int);
+static pa_t alloc_zeroed();
+static bool zero_idle();
+static uint64_t npages();
+static void stats();
 
-pmmngr_t pmmngr = {init, alloc, free};
+pmmngr_t pmmngr = {init, alloc, free, alloc_pages, free_pages, alloc_zeroed, zero_idle, npages, stats};
 
+extern char _bss_end[]; // Defined in linker script
+extern char _ram_end[]; // Defined in linker script
+
+/*
+    Buddy allocator
+
+    Free memory is kept as blocks of 2^order pages, 0 <= order
+    <= MAXORDER, each aligned to its own size, on one free list
+    per order. A block of order k at pa has exactly one buddy,
+    the other half of the order k+1 block it was split from, at
+    pa ^ (PGSIZE << k).
+
+    alloc_pages takes a block from the smallest non-empty list
+    of at least the requested order and splits it in halves,
+    putting the upper halves back, until it is the right size.
+    free_pages merges a block with its buddy for as long as the
+    buddy is free and of the same order, so freed memory always
+    ends up in the largest blocks possible.
+
+    Whether a buddy is free (and of which order) is recorded in
+    a tag byte per page, only meaningful for the first page of
+    a block; the other pages' tags never read as free. The tag
+    array lives at the start of the free
+    section, before the first managed page:
+
+        +------------------+  <-  _ram_end (buddy.end)
+        |    untouched     |
+        +------------------+  <-  buddy.frontier
+        |   managed pages  |
+        +------------------+  <-  buddy.base (4K aligned)
+        |       tags       |
+        +------------------+  <-  _bss_end
+
+    Memory is handed to the buddy allocator lazily. Nothing
+    above buddy.frontier has been written to yet, not even its
+    tags; it is all free by definition. When no free list can
+    satisfy a request, the next aligned block is carved off at
+    the frontier, its tags cleared, so init does a constant amount of work no
+    matter how much RAM there is, and a page is first touched
+    when it is first needed.
+*/
+
+#define TAG_FREE 0x80 // or'ed with the order of a free block
+
+// Links of a free block, kept in the block itself
 typedef struct blk blk_t;
 struct blk {
     blk_t *next;
-    char _[4096 - sizeof(blk_t *)];
+    blk_t *prev;
 };
 
-extern char _bss_end[]; // Defined in linker script
-extern char _ram_end[]; // Defined in linker script
+static struct {
+    spinlk_t lk;
+    blk_t *free[MAXORDER + 1]; // free lists, one per order
+    uint64_t nfree[MAXORDER + 1];
+    uint8_t *tags;
+    pa_t base;
+    pa_t frontier; // start of the untouched memory
+    pa_t end;
+} buddy = {SPINLK_INITIALIZER};
+
+#define TAG(pa) buddy.tags[((pa) - buddy.base) / PGSIZE]
+
+// Put the block at pa on the free list of order
+static void push(pa_t pa, int order) {
+    blk_t *b = (blk_t *)pa;
+    b->prev = 0;
+    b->next = buddy.free[order];
+    if (b->next)
+        b->next->prev = b;
+    buddy.free[order] = b;
+    buddy.nfree[order]++;
+    TAG(pa) = TAG_FREE | order;
+}
+
+// Take the block at pa off the free list of order
+static void unlink(pa_t pa, int order) {
+    blk_t *b = (blk_t *)pa;
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        buddy.free[order] = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    buddy.nfree[order]--;
+    TAG(pa) = 0;
+}
+
+// Move the largest aligned block that fits from the untouched
+// memory to the free lists, return 0 if there is none left
+// Caller must hold buddy.lk
+static bool carve() {
+    pa_t pa = buddy.frontier;
+    if (pa >= buddy.end)
+        return 0;
+    int k = MAXORDER;
+    while (k && ((pa & (((pa_t)PGSIZE << k) - 1)) || pa + ((pa_t)PGSIZE << k) > buddy.end))
+        k--;
+    buddy.frontier += (pa_t)PGSIZE << k;
+    // RAM need not come up zeroed, and buddy_free reads the tag
+    // of any page of the block that becomes a buddy, so none of
+    // them may look free by chance
+    memset(&TAG(pa), 0, (size_t)1 << k);
+    push(pa, k);
+    return 1;
+}
+
+// Caller must hold buddy.lk
+static pa_t buddy_alloc(int order) {
+    int k;
+    for (;;) {
+        for (k = order; k <= MAXORDER && !buddy.free[k]; k++)
+            ;
+        if (k <= MAXORDER)
+            break;
+        if (!carve())
+            return 0;
+    }
+
+    pa_t pa = (pa_t)buddy.free[k];
+    unlink(pa, k);
+
+    // split until the block is of the requested size
+    // and free the upper half each time
+    while (k > order) {
+        k--;
+        push(pa + ((pa_t)PGSIZE << k), k);
+    }
+
+    TAG(pa) = order; // allocated, TAG_FREE clear
+    return pa;
+}
+
+// Caller must hold buddy.lk
+static void buddy_free(pa_t pa, int order) {
+    while (order < MAXORDER) {
+        pa_t b = pa ^ ((pa_t)PGSIZE << order);
+        // the tags of untouched memory are garbage, and blocks
+        // there are carved whole so they never are a buddy
+        if (b < buddy.base || b + ((pa_t)PGSIZE << order) > buddy.frontier)
+            break;
+        if (TAG(b) != (TAG_FREE | order))
+            break;
+        // buddy is free, merge the two into one block of order + 1
+        unlink(b, order);
+        if (b < pa)
+            pa = b;
+        order++;
+    }
+    push(pa, order);
+}
+
+/*
+    Per-hart page magazines
+
+    Each hart keeps a small stack (magazine) of free pages
+    in front of the buddy allocator, indexed by the hart id in tp. alloc
+    and free only touch the calling hart's magazine, and
+    buddy.lk is taken once per MAGBATCH pages: when the
+    magazine runs dry it is refilled with a batch of order 0
+    blocks from the buddy allocator, and when it overflows a
+    batch is drained back (and coalesced) there.
+
+    A magazine is only ever touched by its own hart, so it
+    needs no lock, just interrupts off so a trap on the same
+    hart can not observe it half updated.
+
+    MAGSIZE can be overridden at build time (make MAGSIZE=n)
+*/
+#ifndef MAGSIZE
+#define MAGSIZE 64
+#endif
+#define MAGBATCH (MAGSIZE / 2)
+
+typedef struct mag {
+    int n;              // number of pages in the magazine
+    pa_t pages[MAGSIZE];
+    uint64_t allocs;    // calls to alloc
+    uint64_t hits;      // allocs served without touching buddy
+    uint64_t refills;   // batches taken from buddy
+    uint64_t frees;     // calls to free
+    uint64_t drains;    // batches returned to buddy
+} __attribute__((aligned(64))) mag_t; // one cache line apart so harts don't false share
+
+static mag_t mags[NCPU];
+
+/*
+    Pre-zeroed page pool
+
+    Harts with nothing else to do call zero_idle, which zeroes
+    one page at a time into zpool until it holds ZPOOL_SIZE pages.
+    alloc_zeroed takes from the pool, so zeroing is paid for on
+    an idle hart and not on the caller's path. It falls back to
+    zeroing a fresh page only if the pool runs dry.
+*/
+#define ZPOOL_SIZE 64
 
-// A "stack" of free blocks
-// A block is added to the top when freed
-// and is taken from the top when allocated
 static struct {
     spinlk_t lk;
-    blk_t*  top;
-} bstack = {SPINLK_INITIALIZER, 0};
+    int n;
+    pa_t pages[ZPOOL_SIZE];
+    uint64_t hits;   // alloc_zeroed served from the pool
+    uint64_t misses; // alloc_zeroed that had to zero a page itself
+} zpool = {SPINLK_INITIALIZER};
 
 // init will be called only once in _main,
 // and is only executed by hart 0, so we do
-// not need to lock freeblks (Other harts 
+// not need to lock buddy (Other harts 
 // are blocked until hart 0 finishes the
 // entire initilization process)
 void init() {
-    // Divide the free region into 4K blocks
-    // and push them all into the free block stack
+    // Reserve a tag byte for each page in the free section,
+    // then manage what is left. Neither the tags nor the pages
+    // are written here; carve() clears the tags of each block
+    // it hands out.
+    pa_t npages = ((pa_t)_ram_end - (pa_t)_bss_end) / PGSIZE;
+    buddy.tags = (uint8_t *)_bss_end;
+    buddy.base = ((pa_t)_bss_end + npages + PGSIZE - 1) & ~(pa_t)(PGSIZE - 1);
+    buddy.frontier = buddy.base;
+    buddy.end = (pa_t)_ram_end;
+}
 
-    // First block
-    if ((blk_t *)_bss_end < (blk_t *)_ram_end) {
-        bstack.top = (blk_t *)_bss_end;
-        bstack.top->next = 0;
-    }
+// Move up to MAGBATCH pages from buddy into m
+static void refill(mag_t *m) {
+    spinlk_acquire(&buddy.lk);
+    pa_t pa;
+    while (m->n < MAGBATCH && (pa = buddy_alloc(0)))
+        m->pages[m->n++] = pa;
+    spinlk_release(&buddy.lk);
+    m->refills++;
+}
 
-    for (blk_t *p = (blk_t *)_bss_end; p < (blk_t *)_ram_end; p += 1) {
-        p->next = bstack.top;
-        bstack.top = p;
-    }
+// Move MAGBATCH pages from m back to buddy
+static void drain(mag_t *m) {
+    spinlk_acquire(&buddy.lk);
+    for (int i = 0; i < MAGBATCH; i++)
+        buddy_free(m->pages[--m->n], 0);
+    spinlk_release(&buddy.lk);
+    m->drains++;
 }
 
 pa_t alloc() {
-    spinlk_acquire(&bstack.lk);
-    pa_t b = (pa_t)bstack.top;
-    bstack.top = bstack.top->next;
-    spinlk_release(&bstack.lk);
-    return b; // will return 0 if bstack is empty meaning on free blocks
+    push_off();
+    mag_t *m = &mags[r_tp()];
+    m->allocs++;
+    if (m->n)
+        m->hits++;
+    else
+        refill(m);
+    pa_t b = m->n ? m->pages[--m->n] : 0;
+    pop_off();
+    return b; // will return 0 if there are no free pages left
 }
 
 void free(pa_t pa) {
-    blk_t *p = (blk_t*)pa;
+    push_off();
+    mag_t *m = &mags[r_tp()];
+    m->frees++;
+    if (m->n == MAGSIZE)
+        drain(m);
+    m->pages[m->n++] = pa;
+    pop_off();
+}
 
-    spinlk_acquire(&bstack.lk);
-    if (!bstack.top) {
-        p->next = 0;
-        bstack.top = p;
+// Single pages go through the calling hart's magazine,
+// larger blocks straight to the buddy allocator
+pa_t alloc_pages(int order) {
+    if (order == 0)
+        return alloc();
+    if (order < 0 || order > MAXORDER)
+        return 0;
+    spinlk_acquire(&buddy.lk);
+    pa_t pa = buddy_alloc(order);
+    spinlk_release(&buddy.lk);
+    return pa;
+}
+
+void free_pages(pa_t pa, int order) {
+    if (order == 0) {
+        free(pa);
+        return;
+    }
+    spinlk_acquire(&buddy.lk);
+    buddy_free(pa, order);
+    spinlk_release(&buddy.lk);
+}
+
+static void zero(pa_t pa) {
+    uint64_t *p = (uint64_t *)pa;
+    for (int i = 0; i < PGSIZE / sizeof(uint64_t); i++)
+        p[i] = 0;
+}
+
+pa_t alloc_zeroed() {
+    pa_t pa = 0;
+    spinlk_acquire(&zpool.lk);
+    if (zpool.n) {
+        pa = zpool.pages[--zpool.n];
+        zpool.hits++;
+    } else {
+        zpool.misses++;
     }
-    else {
-        p->next = bstack.top;
-        bstack.top = bstack.top->next;
+    spinlk_release(&zpool.lk);
+
+    if (!pa && (pa = alloc()))
+        zero(pa);
+    return pa;
+}
+
+bool zero_idle() {
+    if (zpool.n == ZPOOL_SIZE) // racy peek, rechecked below
+        return 0;
+
+    pa_t pa = alloc();
+    if (!pa)
+        return 0;
+    zero(pa);
+
+    spinlk_acquire(&zpool.lk);
+    bool full = zpool.n == ZPOOL_SIZE;
+    if (!full)
+        zpool.pages[zpool.n++] = pa;
+    spinlk_release(&zpool.lk);
+
+    if (full)
+        free(pa);
+    return !full;
+}
+
+uint64_t npages() {
+    return (buddy.end - buddy.base) / PGSIZE;
+}
+
+// Dump magazine counters for every hart that has used its magazine
+// hit rate = hits / allocs, followed by the buddy free lists
+void stats() {
+    for (int i = 0; i < NCPU; i++) {
+        mag_t *m = &mags[i];
+        if (!m->allocs && !m->frees)
+            continue;
+        kprintf("pm: hart %d: %d allocs (%d%% hit, %d refills), %d frees (%d drains), %d cached\n",
+                i, (int)m->allocs, m->allocs ? (int)(m->hits * 100 / m->allocs) : 0,
+                (int)m->refills, (int)m->frees, (int)m->drains, m->n);
     }
-    spinlk_release(&bstack.lk);
+    kprintf("pm: free blocks by order:");
+    for (int k = 0; k <= MAXORDER; k++)
+        kprintf(" %d", (int)buddy.nfree[k]);
+    kprintf(", %dK untouched\n", (int)((buddy.end - buddy.frontier) >> 10));
+    kprintf("pm: zeroed pool: %d pages, %d hits, %d misses\n",
+            zpool.n, (int)zpool.hits, (int)zpool.misses);
 }
@@ -0,0 +1,234 @@
+#include "../include/slab.h"
+#include "../include/pm.h"
+#include "../include/spinlk.h"
+#include "../include/hart.h"
+#include "../include/kprintf.h"
+
+/*
+    Slab allocator
+
+    A cache hands out objects of one size. Its memory comes in
+    slabs, runs of 2^order pages from pmmngr, each laid out as
+
+        +------+-----+-----+-----+-----+------+
+        | slab | obj | obj | obj | ... | waste|
+        +------+-----+-----+-----+-----+------+
+        ^ aligned to the slab size
+
+    The slab header keeps a list of the free objects in that slab
+    (linked through the objects themselves). Since slabs are
+    aligned to their size, the slab an object belongs to is found
+    by masking off the low bits of its address.
+
+    In front of the slabs each hart keeps a small magazine of
+    free objects for every cache, the same scheme as the page
+    magazines in pm.c. Allocation and free only touch the
+    calling hart's magazine, and the cache lock is taken once
+    per SLAB_BATCH objects to refill or drain it.
+*/
+
+#define NCACHE 16       // maximum number of caches
+#define SLAB_MAGSIZE 14 // objects kept per hart per cache
+#define SLAB_BATCH (SLAB_MAGSIZE / 2)
+#define SLAB_MAXORDER 3 // largest slab is 8 pages
+
+typedef struct slab slab_t;
+struct slab {
+    kmem_cache_t *cache;
+    slab_t *next;
+    slab_t *prev;
+    void *free;   // free objects in this slab
+    int inuse;    // objects handed out (including those in magazines)
+};
+
+typedef struct obj obj_t;
+struct obj {
+    obj_t *next;
+};
+
+struct kmem_cache {
+    const char *name;
+    size_t size;  // object size, rounded up to align
+    size_t off;   // offset of the first object in a slab
+    int order;    // slab size is PGSIZE << order
+    int perslab;  // objects per slab
+    spinlk_t lk;  // guards the lists below
+    slab_t *partial;
+    slab_t *full;
+    slab_t *empty; // at most one, kept to avoid thrashing pmmngr
+    int nslabs;
+    struct {
+        int n;
+        void *objs[SLAB_MAGSIZE];
+    } __attribute__((aligned(64))) cpu[NCPU];
+};
+
+static kmem_cache_t caches[NCACHE];
+static int ncaches;
+static spinlk_t lk = SPINLK_INITIALIZER; // guards ncaches
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align) {
+    if (!align)
+        align = sizeof(void *);
+    if ((align & (align - 1)) || align > PGSIZE)
+        return 0;
+    if (size < sizeof(obj_t))
+        size = sizeof(obj_t);
+    size = (size + align - 1) & ~(align - 1);
+
+    size_t off = (sizeof(slab_t) + align - 1) & ~(align - 1);
+
+    // use the smallest slab that wastes no more than 1/8 of itself
+    int order = 0;
+    for (;; order++) {
+        size_t slabsz = (size_t)PGSIZE << order;
+        if (off + size <= slabsz && ((slabsz - off) % size) * 8 <= slabsz)
+            break;
+        if (order == SLAB_MAXORDER) {
+            if (off + size > slabsz)
+                return 0;
+            break;
+        }
+    }
+
+    spinlk_acquire(&lk);
+    if (ncaches == NCACHE) {
+        spinlk_release(&lk);
+        return 0;
+    }
+    kmem_cache_t *c = &caches[ncaches++];
+    spinlk_release(&lk);
+
+    c->name = name;
+    c->size = size;
+    c->off = off;
+    c->order = order;
+    c->perslab = (((size_t)PGSIZE << order) - off) / size;
+    spinlk_init(&c->lk);
+    return c;
+}
+
+static void list_remove(slab_t **head, slab_t *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+}
+
+static void list_push(slab_t **head, slab_t *s) {
+    s->prev = 0;
+    s->next = *head;
+    if (s->next)
+        s->next->prev = s;
+    *head = s;
+}
+
+// Caller must hold c->lk
+static slab_t *slab_new(kmem_cache_t *c) {
+    slab_t *s = (slab_t *)pmmngr.alloc_pages(c->order);
+    if (!s)
+        return 0;
+    s->cache = c;
+    s->inuse = 0;
+    s->free = 0;
+    // thread the objects onto the free list back to front
+    // so they are handed out in address order
+    for (int i = c->perslab - 1; i >= 0; i--) {
+        obj_t *o = (obj_t *)((char *)s + c->off + i * c->size);
+        o->next = s->free;
+        s->free = o;
+    }
+    c->nslabs++;
+    return s;
+}
+
+// Move up to SLAB_BATCH objects from the slabs of c into the
+// magazine of this hart, caller must hold c->lk
+static void refill(kmem_cache_t *c, int hart) {
+    while (c->cpu[hart].n < SLAB_BATCH) {
+        slab_t *s = c->partial;
+        if (!s) {
+            if ((s = c->empty))
+                c->empty = 0;
+            else if (!(s = slab_new(c)))
+                return;
+            list_push(&c->partial, s);
+        }
+        obj_t *o = s->free;
+        s->free = o->next;
+        s->inuse++;
+        c->cpu[hart].objs[c->cpu[hart].n++] = o;
+        if (!s->free) {
+            list_remove(&c->partial, s);
+            list_push(&c->full, s);
+        }
+    }
+}
+
+// Move SLAB_BATCH objects from the magazine of this hart back
+// to their slabs, caller must hold c->lk
+static void drain(kmem_cache_t *c, int hart) {
+    size_t slabsz = (size_t)PGSIZE << c->order;
+    for (int i = 0; i < SLAB_BATCH; i++) {
+        obj_t *o = c->cpu[hart].objs[--c->cpu[hart].n];
+        slab_t *s = (slab_t *)((uint64_t)o & ~(slabsz - 1));
+        if (!s->free) {
+            list_remove(&c->full, s);
+            list_push(&c->partial, s);
+        }
+        o->next = s->free;
+        s->free = o;
+        if (--s->inuse)
+            continue;
+        // slab is empty, keep one around and give the rest back
+        list_remove(&c->partial, s);
+        if (!c->empty) {
+            c->empty = s;
+        } else {
+            pmmngr.free_pages((pa_t)s, c->order);
+            c->nslabs--;
+        }
+    }
+}
+
+void *kmem_cache_alloc(kmem_cache_t *c) {
+    push_off();
+    int hart = r_tp();
+    if (!c->cpu[hart].n) {
+        spinlk_acquire(&c->lk);
+        refill(c, hart);
+        spinlk_release(&c->lk);
+    }
+    void *o = c->cpu[hart].n ? c->cpu[hart].objs[--c->cpu[hart].n] : 0;
+    pop_off();
+    return o;
+}
+
+void kmem_cache_free(kmem_cache_t *c, void *obj) {
+    push_off();
+    int hart = r_tp();
+    if (c->cpu[hart].n == SLAB_MAGSIZE) {
+        spinlk_acquire(&c->lk);
+        drain(c, hart);
+        spinlk_release(&c->lk);
+    }
+    c->cpu[hart].objs[c->cpu[hart].n++] = obj;
+    pop_off();
+}
+
+void kmem_cache_stats(void) {
+    for (int i = 0; i < ncaches; i++) {
+        kmem_cache_t *c = &caches[i];
+        int inuse = 0;
+        spinlk_acquire(&c->lk);
+        for (slab_t *s = c->partial; s; s = s->next)
+            inuse += s->inuse;
+        for (slab_t *s = c->full; s; s = s->next)
+            inuse += s->inuse;
+        spinlk_release(&c->lk);
+        kprintf("slab: %s: %d bytes, %d per slab, %d slabs, %d objects out\n",
+                c->name, (int)c->size, c->perslab, c->nslabs, inuse);
+    }
+}
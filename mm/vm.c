@@ -2,8 +2,8 @@
 #include "../include/types.h"
 #include "../include/pm.h"
 #include "../include/kpanic.h"
-#include "../include/util.h"
 #include "../include/hart.h"
+#include "../include/spinlk.h"
 
 typedef struct pte {
     uint64_t valid:1;
@@ -23,59 +23,230 @@ typedef struct pt {
     pte_t arr[512];
 } __attribute__((packed)) pt_t;
 
-typedef struct _va {
-    uint64_t vpo:12;
-    uint64_t vpn1:9;
-    uint64_t vpn2:9;
-    uint64_t vpn3:9;
-    uint64_t paddinh:25;
-} __attribute__((packed)) _va_t;
-
 static pt_t *kernelpt = 0;
+static spinlk_t lk = SPINLK_INITIALIZER; // guards kernelpt after init
 
-static void init(void);
-static void init_map(pa_t pa, va_t va, int flags);
+// ASID allocator, see vmspace_switch
+static struct {
+    spinlk_t lk;
+    uint64_t max;  // largest ASID, 0 if the hart has none
+    uint64_t gen;  // current generation
+    uint64_t next; // next ASID to hand out in this generation
+} asids = {SPINLK_INITIALIZER, 0, 1, 1};
 
-vmmngr_t vmmngr = {init};
+// generation each hart has last flushed its TLB for
+static uint64_t hartgen[NCPU];
 
-void init_map(pa_t pa, va_t va, int flags) {
+// Size of the page mapped by a leaf PTE in a table of the given level
+// (0: root, 1G gigapages, 1: 2M megapages, 2: 4K pages)
+#define LVLSIZE(level) (1L << (12 + 9 * (2 - (level))))
 
-    // starting from level-1 page table
-    // iteratively find level-3 table
-    // and the entry that corresponds to
-    // the physical address
-    // and write pa to the ppn field.
-    // will allocate page tables
-    // along the way if necessary
+// Index into the table at the given level for va
+#define VPN(va, level) (((va) >> (12 + 9 * (2 - (level)))) & 0x1ff)
 
-    // break vpn into three 9-bit parts
-    // which will be used to index page tables
-    _va_t* _va = (_va_t*)&va;
-    uint64_t vpns[3] = {_va->vpn3, _va->vpn2, _va->vpn1};
+// Window for demand paged regions, one root entry
+#define LAZYBASE 0x1000000000L
+#define LAZYSIZE (1L << 30)
 
-    pt_t* pt = kernelpt;
-    pte_t* pte;
+// satp for Sv39 translation through root, tagged with asid
+#define SATP(root, asid) (8L << 60 | (uint64_t)(asid) << 44 | (pa_t)(root) >> 12)
 
-    for (int i = 0; i < 3; i++) {
-        pte = &pt->arr[vpns[i]];
-        // break if reached level 3
-        // pte ends up corresponding to the intended physical address
-        if (i != 2) {
-            if (!pte->valid) { // allocate the page table if unallocated
-                pa_t tmp = (pa_t)pmmngr.alloc();
-                memset((void *)tmp, 0, 4096);
-                pte->valid = 1;
-                pte->ppn = tmp >> 12;
-            }
-            pt = (pt_t*)(uint64_t)(pte->ppn << 12); // get the next level page table
-        }
-    }
+#define ISLEAF(pte) ((pte)->readable || (pte)->writable || (pte)->executable)
 
-    pte->valid = 1;
+static void init(void);
+static void inithart(void);
+static int map_range(va_t va, pa_t pa, size_t len, int flags);
+static void unmap_range(va_t va, size_t len);
+static void protect_range(va_t va, size_t len, int flags);
+static va_t reserve(size_t len, int flags);
+static bool fault(va_t va, int cause);
+
+vmmngr_t vmmngr = {init, inithart, map_range, unmap_range, protect_range, reserve, fault};
+
+static void setleaf(pte_t *pte, pa_t pa, int flags) {
     pte->ppn = pa >> 12;
     pte->readable = !!(flags & PTE_R);
     pte->writable = !!(flags & PTE_W);
     pte->executable = !!(flags & PTE_X);
+    pte->global = !!(flags & PTE_G);
+    pte->valid = 1;
+}
+
+// Starting from the root, return the table at `level`
+// that va falls in, allocating tables along the way if
+// alloc is set. Returns 0 if a table is missing (and not
+// allocated) or va is covered by a larger superpage.
+static pt_t *walk(pt_t *root, va_t va, int level, bool alloc) {
+    pt_t *pt = root;
+    for (int i = 0; i < level; i++) {
+        pte_t *pte = &pt->arr[VPN(va, i)];
+        if (!pte->valid) {
+            if (!alloc)
+                return 0;
+            pa_t tmp = pmmngr.alloc_zeroed();
+            if (!tmp)
+                return 0;
+            pte->valid = 1;
+            pte->ppn = tmp >> 12;
+        }
+        else if (ISLEAF(pte))
+            return 0;
+        pt = (pt_t*)(uint64_t)(pte->ppn << 12); // get the next level page table
+    }
+    return pt;
+}
+
+// The largest page (as a leaf level) that both pa and va are
+// aligned to and that fits within len
+static int fitlevel(pa_t pa, va_t va, size_t len) {
+    int level = 0;
+    while (level < 2 && (((pa | va) & (LVLSIZE(level) - 1)) || len < LVLSIZE(level)))
+        level++;
+    return level;
+}
+
+// Map [pa, pa + len) at va in the page table at root, each step
+// with the largest page (1G, 2M or 4K) that both addresses are
+// aligned to and that still fits in what is left of the range.
+// Consecutive entries of one table are filled in a single pass,
+// and the tables are only walked again when the range crosses
+// into the next table or the page size changes.
+// Returns -1 if out of memory or part of the range is mapped
+// already, in which case the range may be partially mapped.
+static int map(pt_t *root, va_t va, pa_t pa, size_t len, int flags) {
+    while (len) {
+        int level = fitlevel(pa, va, len);
+        pt_t *pt = walk(root, va, level, 1);
+        if (!pt)
+            return -1;
+        size_t sz = LVLSIZE(level);
+        for (int i = VPN(va, level); i < 512 && len && fitlevel(pa, va, len) == level; i++) {
+            if (pt->arr[i].valid)
+                return -1;
+            setleaf(&pt->arr[i], pa, flags);
+            pa += sz;
+            va += sz;
+            len -= sz;
+        }
+    }
+    return 0;
+}
+
+// Replace the superpage at pte (a leaf in a table at level)
+// with a table of the next level mapping the same memory
+static int split(pte_t *pte, int level) {
+    pt_t *pt = (pt_t *)pmmngr.alloc_zeroed();
+    if (!pt)
+        return -1;
+    int flags = (pte->readable ? PTE_R : 0) | (pte->writable ? PTE_W : 0) |
+                (pte->executable ? PTE_X : 0) | (pte->global ? PTE_G : 0);
+    pa_t pa = (pa_t)pte->ppn << 12;
+    for (int i = 0; i < 512; i++)
+        setleaf(&pt->arr[i], pa + i * LVLSIZE(level + 1), flags);
+    pte->readable = pte->writable = pte->executable = 0;
+    pte->ppn = (pa_t)pt >> 12;
+    return 0;
+}
+
+// Find the table holding the leaf that maps va, splitting
+// superpages that are only partly inside [va, va + len).
+// Returns 0 and sets *level to the level the walk stopped at
+// if va is not mapped.
+static pt_t *leaftbl(pt_t *root, va_t va, size_t len, int *level) {
+    pt_t *pt = root;
+    for (int i = 0; ; i++) {
+        pte_t *pte = &pt->arr[VPN(va, i)];
+        *level = i;
+        if (!pte->valid)
+            return 0;
+        if (ISLEAF(pte)) {
+            if (!(va & (LVLSIZE(i) - 1)) && len >= LVLSIZE(i))
+                return pt;
+            if (split(pte, i))
+                kpanic("vm: out of memory splitting a superpage\n");
+        }
+        pt = (pt_t*)(uint64_t)(pte->ppn << 12);
+    }
+}
+
+// Ranges over this many pages flush the whole address space
+// rather than page by page
+#define FLUSH_PAGES 64
+
+// Drop the TLB entry for va, in the address space asid
+// or in all of them (and global entries) if asid < 0.
+// This only affects the calling hart, other harts are not
+// expected to be using the old mapping
+static void flush(va_t va, long asid) {
+    if (asid < 0)
+        asm volatile ("sfence.vma %0, zero" :: "r"(va));
+    else
+        asm volatile ("sfence.vma %0, %1" :: "r"(va), "r"(asid));
+}
+
+// Apply op to every leaf in [va, va + len), one pass over each
+// leaf table, skipping holes a whole table at a time
+#define OP_UNMAP -1
+static void update(pt_t *root, va_t va, size_t len, int op, long asid) {
+    while (len) {
+        int level;
+        pt_t *pt = leaftbl(root, va, len, &level);
+        size_t sz = LVLSIZE(level);
+        if (!pt) {
+            // nothing mapped up to the next boundary at this level
+            size_t skip = sz - (va & (sz - 1));
+            if (skip >= len)
+                return;
+            va += skip;
+            len -= skip;
+            continue;
+        }
+        for (int i = VPN(va, level); i < 512 && len >= sz; i++) {
+            pte_t *pte = &pt->arr[i];
+            if (pte->valid && !ISLEAF(pte))
+                break; // a table, walk down to it
+            if (pte->valid) {
+                if (op == OP_UNMAP)
+                    *(uint64_t *)pte = 0;
+                else
+                    setleaf(pte, (pa_t)pte->ppn << 12, op | (pte->global ? PTE_G : 0));
+                flush(va, asid);
+            }
+            va += sz;
+            len -= sz;
+        }
+    }
+}
+
+// Widen [va, va + len) to whole 4K pages
+#define PGALIGN(va, len) do { \
+    (len) = ((len) + ((va) & (PGSIZE - 1)) + PGSIZE - 1) & ~(size_t)(PGSIZE - 1); \
+    (va) &= ~(va_t)(PGSIZE - 1); \
+} while (0)
+
+int map_range(va_t va, pa_t pa, size_t len, int flags) {
+    pa &= ~(pa_t)(PGSIZE - 1);
+    PGALIGN(va, len);
+    spinlk_acquire(&lk);
+    int r = map(kernelpt, va, pa, len, flags | PTE_G);
+    spinlk_release(&lk);
+    return r;
+}
+
+void unmap_range(va_t va, size_t len) {
+    PGALIGN(va, len);
+    spinlk_acquire(&lk);
+    update(kernelpt, va, len, OP_UNMAP, -1);
+    spinlk_release(&lk);
+}
+
+void protect_range(va_t va, size_t len, int flags) {
+    if (!(flags & (PTE_R | PTE_W | PTE_X)))
+        kpanic("protect_range: no permissions, use unmap_range\n");
+    PGALIGN(va, len);
+    spinlk_acquire(&lk);
+    update(kernelpt, va, len, flags & (PTE_R | PTE_W | PTE_X), -1);
+    spinlk_release(&lk);
 }
 
 
@@ -94,11 +265,15 @@ void init_map(pa_t pa, va_t va, int flags) {
     |         K stack 1             |
     +-------------------------------+
     |                               |
-    |                               |
     |             ...               |
     |                               |
+    +-------------------------------+ 0x1040000000 (65G)
+    |         Lazy regions          | RW, backed on first touch
+    +-------------------------------+ 0x1000000000 (64G)
     |                               |
-    +-------------------------------+ 0x88000000 (2G + 128M)
+    |             ...               |
+    |                               |
+    +-------------------------------+ _ram_end (2G + MEM)
     |         Kernel data           | RW
     +-------------------------------+
     |         Kernel Text           | RX
@@ -124,38 +299,276 @@ void init_map(pa_t pa, va_t va, int flags) {
 extern char _text_end[];
 extern char _ram_end[];
 
+// Map an identity range at boot
+static void kmap(pa_t pa, size_t len, int flags) {
+    if (map(kernelpt, pa, pa, len, flags | PTE_G))
+        kpanic("vm: failed to map kernel address space\n");
+}
+
 void init() {
     // allocate kernel page table
-    kernelpt = (pt_t*)pmmngr.alloc();
-    memset((void*)kernelpt, 0, 4096);
+    kernelpt = (pt_t*)pmmngr.alloc_zeroed();
 
     // PLIC
-    for (pa_t pa = 0xC000000; pa < 0xC400000; pa += 4096)
-        init_map(pa, pa, PTE_R | PTE_W);
+    kmap(0xC000000, 0x400000, PTE_R | PTE_W);
     
     // UART 0
-    for (pa_t pa = 0x10000000; pa < 0x10001000; pa += 4096)
-        init_map(pa, pa, PTE_R | PTE_W);
+    kmap(0x10000000, 0x1000, PTE_R | PTE_W);
 
     // VIRTO Disk
-    for (pa_t pa = 0x10001000; pa < 0x10002000; pa += 4096)
-        init_map(pa, pa, PTE_R | PTE_W);
+    kmap(0x10001000, 0x1000, PTE_R | PTE_W);
     
     // kernel code (text)
-    for (pa_t pa = 0x80000000; pa < (pa_t)_text_end; pa += 4096)
-        init_map(pa, pa, PTE_R | PTE_W | PTE_X);
+    kmap(0x80000000, (pa_t)_text_end - 0x80000000, PTE_R | PTE_W | PTE_X);
     
-    // kernel data
-    for (pa_t pa = (pa_t)_text_end; pa < (pa_t)_ram_end; pa += 4096)
-        init_map(pa, pa, PTE_R | PTE_W);
+    // kernel data and the rest of RAM
+    // 4K up to the first 2M boundary, then mostly megapages
+    // (and gigapages from 3G on if there is that much RAM)
+    kmap((pa_t)_text_end, (pa_t)_ram_end - (pa_t)_text_end, PTE_R | PTE_W);
+
+    // Lazy regions, only the table under the root entry
+    // so that address spaces created later share it
+    if (!walk(kernelpt, LAZYBASE, 1, 1))
+        kpanic("vm: failed to map kernel address space\n");
+
+    inithart();
 
-    // Install kernel page table
+    // Find out how many ASID bits are implemented
+    // by writing all ones and reading back what stuck
+    w_satp(SATP(kernelpt, 0xFFFF));
+    asids.max = (r_satp() >> 44) & 0xFFFF;
+    w_satp(SATP(kernelpt, 0));
+    asm ("sfence.vma zero, zero");
+}
 
+// Install kernel page table
+void inithart() {
     // Flush TLB to make sure it starts off clean
     // Use memory fence to make sure memory operations that needs phsycial addresses
     // happend strictly before paging's turned on, and vice versa
     asm ("sfence.vma zero, zero");
-    w_satp((pa_t)kernelpt >> 12 | (1L << 63));
+    w_satp(SATP(kernelpt, 0));
     asm ("sfence.vma zero, zero");
 }
 
+/*
+    Demand paging
+
+    reserve hands out kernel virtual address space from the
+    lazy window without mapping anything. The first access to
+    each page traps as a page fault; fault finds the region it
+    belongs to, maps a zeroed page there, and the faulting
+    instruction is restarted when the trap handler returns.
+*/
+
+#define NREGION 16
+
+static struct {
+    spinlk_t lk;
+    va_t next; // next free address in the window
+    int n;
+    struct {
+        va_t va;
+        size_t len;
+        int flags;
+    } arr[NREGION];
+} regions = {SPINLK_INITIALIZER, LAZYBASE};
+
+va_t reserve(size_t len, int flags) {
+    len = (len + PGSIZE - 1) & ~(size_t)(PGSIZE - 1);
+    spinlk_acquire(&regions.lk);
+    if (regions.n == NREGION || regions.next + len > LAZYBASE + LAZYSIZE) {
+        spinlk_release(&regions.lk);
+        return 0;
+    }
+    va_t va = regions.next;
+    regions.arr[regions.n].va = va;
+    regions.arr[regions.n].len = len;
+    regions.arr[regions.n].flags = flags & (PTE_R | PTE_W | PTE_X);
+    regions.n++;
+    // leave an unmapped guard page between regions
+    regions.next += len + PGSIZE;
+    spinlk_release(&regions.lk);
+    return va;
+}
+
+// Whether va has a valid leaf in the page table at root,
+// caller must hold lk
+static bool mapped(pt_t *root, va_t va) {
+    pt_t *pt = root;
+    for (int i = 0; i < 3; i++) {
+        pte_t *pte = &pt->arr[VPN(va, i)];
+        if (!pte->valid)
+            return 0;
+        if (ISLEAF(pte))
+            return 1;
+        pt = (pt_t*)(uint64_t)(pte->ppn << 12);
+    }
+    return 0;
+}
+
+bool fault(va_t va, int cause) {
+    // permission the access needs
+    int need = cause == 12 ? PTE_X : cause == 13 ? PTE_R : PTE_W;
+
+    int flags = 0;
+    spinlk_acquire(&regions.lk);
+    for (int i = 0; i < regions.n; i++)
+        if (va >= regions.arr[i].va && va < regions.arr[i].va + regions.arr[i].len) {
+            flags = regions.arr[i].flags;
+            break;
+        }
+    spinlk_release(&regions.lk);
+
+    if (!(flags & need))
+        return 0;
+
+    pa_t pa = pmmngr.alloc_zeroed();
+    if (!pa)
+        kpanic("vm: out of memory on page fault\n");
+    va &= ~(va_t)(PGSIZE - 1);
+    // another hart may have faulted on the same page and mapped
+    // it first, in which case its page is as good as ours; any
+    // other failure (out of memory for a table) is fatal
+    if (map_range(va, pa, PGSIZE, flags)) {
+        pmmngr.free(pa);
+        spinlk_acquire(&lk);
+        bool ok = mapped(kernelpt, va);
+        spinlk_release(&lk);
+        if (!ok)
+            kpanic("vm: cannot map page on fault\n");
+    }
+    // the faulting access may have left an invalid entry cached
+    flush(va, -1);
+    return 1;
+}
+
+/*
+    Address spaces and ASIDs
+
+    ASIDs are handed out in order from 1 (0 is the kernel's)
+    until they run out. Then a new generation starts: every
+    ASID handed out so far becomes stale, and each hart flushes
+    its whole TLB once, the first time it switches after the
+    rollover. An address space whose ASID is from an old
+    generation gets a new one the next time it is switched to.
+    Until the rollover, switches and unmaps only ever flush
+    single entries of a single ASID.
+*/
+
+int vmspace_init(vmspace_t *vs) {
+    vs->pt = (pt_t *)pmmngr.alloc_zeroed();
+    if (!vs->pt)
+        return -1;
+    vs->gen = 0; // no ASID yet
+    // share the kernel mappings (tables below the root included)
+    spinlk_acquire(&lk);
+    for (int i = 0; i < 512; i++)
+        vs->pt->arr[i] = kernelpt->arr[i];
+    spinlk_release(&lk);
+    return 0;
+}
+
+static void freetbl(pt_t *pt, int level) {
+    for (int i = 0; i < 512 && level < 2; i++) {
+        pte_t *pte = &pt->arr[i];
+        if (pte->valid && !ISLEAF(pte))
+            freetbl((pt_t *)(uint64_t)(pte->ppn << 12), level + 1);
+    }
+    pmmngr.free((pa_t)pt);
+}
+
+void vmspace_destroy(vmspace_t *vs) {
+    // tables under root entries that are the kernel's are shared
+    for (int i = 0; i < 512; i++) {
+        pte_t *pte = &vs->pt->arr[i];
+        if (pte->valid && !ISLEAF(pte) && !kernelpt->arr[i].valid)
+            freetbl((pt_t *)(uint64_t)(pte->ppn << 12), 1);
+    }
+    pmmngr.free((pa_t)vs->pt);
+    if (vs->gen == asids.gen)
+        asm volatile ("sfence.vma zero, %0" :: "r"(vs->asid));
+    vs->pt = 0;
+}
+
+void vmspace_switch(vmspace_t *vs) {
+    push_off();
+    uint64_t hart = r_tp();
+    if (!vs) {
+        w_satp(SATP(kernelpt, 0));
+        pop_off();
+        return;
+    }
+
+    spinlk_acquire(&asids.lk);
+    if (vs->gen != asids.gen) {
+        if (asids.next > asids.max) {
+            // out of ASIDs, start over in a new generation
+            asids.gen++;
+            asids.next = 1;
+        }
+        // without ASIDs (max = 0) everyone shares ASID 0
+        // and every switch starts a new generation
+        vs->asid = asids.max ? asids.next++ : 0;
+        vs->gen = asids.gen;
+    }
+    bool stale = hartgen[hart] != asids.gen;
+    hartgen[hart] = asids.gen;
+    spinlk_release(&asids.lk);
+
+    w_satp(SATP(vs->pt, vs->asid));
+    if (stale)
+        asm volatile ("sfence.vma zero, zero");
+    pop_off();
+}
+
+// vs may only map where the kernel has nothing, as the
+// tables under the kernel's root entries are shared
+static bool overlaps_kernel(va_t va, size_t len) {
+    for (va_t a = va & ~(LVLSIZE(0) - 1); a < va + len; a += LVLSIZE(0))
+        if (kernelpt->arr[VPN(a, 0)].valid)
+            return 1;
+    return 0;
+}
+
+// ASID to flush entries of vs with, none (a stale generation
+// is flushed whole on the next switch) if it has no valid one
+static long vsasid(vmspace_t *vs) {
+    return vs->gen == asids.gen ? (long)vs->asid : -1;
+}
+
+int vmspace_map(vmspace_t *vs, va_t va, pa_t pa, size_t len, int flags) {
+    pa &= ~(pa_t)(PGSIZE - 1);
+    PGALIGN(va, len);
+    if (overlaps_kernel(va, len))
+        return -1;
+    if (map(vs->pt, va, pa, len, flags & ~PTE_G))
+        return -1;
+    // the hart may hold a cached invalid translation or a stale
+    // walk through a table that was just filled in, so drop them
+    long asid = vsasid(vs);
+    if (asid < 0)
+        return 0;
+    if (len > FLUSH_PAGES * PGSIZE)
+        asm volatile ("sfence.vma zero, %0" :: "r"(asid));
+    else
+        for (size_t off = 0; off < len; off += PGSIZE)
+            flush(va + off, asid);
+    return 0;
+}
+
+void vmspace_unmap(vmspace_t *vs, va_t va, size_t len) {
+    PGALIGN(va, len);
+    if (overlaps_kernel(va, len))
+        kpanic("vmspace_unmap: kernel range\n");
+    update(vs->pt, va, len, OP_UNMAP, vsasid(vs));
+}
+
+void vmspace_protect(vmspace_t *vs, va_t va, size_t len, int flags) {
+    if (!(flags & (PTE_R | PTE_W | PTE_X)))
+        kpanic("vmspace_protect: no permissions, use vmspace_unmap\n");
+    PGALIGN(va, len);
+    if (overlaps_kernel(va, len))
+        kpanic("vmspace_protect: kernel range\n");
+    update(vs->pt, va, len, flags & (PTE_R | PTE_W | PTE_X), vsasid(vs));
+}
@@ -1,4 +1,5 @@
 #include "../include/spinlk.h"
+#include "../include/hart.h"
 
 void spinlk_init(spinlk_t *lk) {
     lk->lk = 0;
@@ -6,7 +7,10 @@ void spinlk_init(spinlk_t *lk) {
 
 // BLOCK (spin) until lk is acquired
 // Return if lk is acquired
+// Interrupts stay off on this hart while it holds a lock so
+// an interrupt handler taking the same lock can't deadlock
 void spinlk_acquire(spinlk_t *lk) {
+    push_off();
     asm (
         "try_lk:"
             "li t0, 1;"
@@ -24,4 +28,24 @@ void spinlk_release(spinlk_t *lk) {
         "amoswap.w.rl zero, zero, (t0);"
         :: "r"(&lk->lk)
     );
+    pop_off();
+}
+
+// Per-hart interrupt nesting state for push_off/pop_off
+static struct {
+    int noff;   // depth of push_off nesting
+    int intena; // were interrupts enabled before the first push_off?
+} cpus[NCPU];
+
+void push_off(void) {
+    uint64_t sstatus = r_sstatus();
+    w_sstatus(sstatus & ~(1 << 1)); // clear SIE
+    if (cpus[r_tp()].noff == 0)
+        cpus[r_tp()].intena = !!(sstatus & (1 << 1));
+    cpus[r_tp()].noff++;
+}
+
+void pop_off(void) {
+    if (--cpus[r_tp()].noff == 0 && cpus[r_tp()].intena)
+        w_sstatus(r_sstatus() | 1 << 1);
 }
@@ -3,25 +3,54 @@ import time
 import os
 
     # // PLIC
-    # for (pa_t pa = 0xC000000; pa < 0xC400000; pa += 4096)
-    #     init_map(pa, pa, PTE_R | PTE_W);
+    # kmap(0xC000000, 0x400000, PTE_R | PTE_W);
     
     # // UART 0
-    # for (pa_t pa = 0x10000000; pa < 0x10001000; pa += 4096)
-    #     init_map(pa, pa, PTE_R | PTE_W);
+    # kmap(0x10000000, 0x1000, PTE_R | PTE_W);
 
     # // VIRTO Disk
-    # for (pa_t pa = 0x10001000; pa < 0x10002000; pa += 4096)
-    #     init_map(pa, pa, PTE_R | PTE_W);
+    # kmap(0x10001000, 0x1000, PTE_R | PTE_W);
     
     # // kernel code (text)
-    # asm ("de:");
-    # for (pa_t pa = 0x80000000; pa < (pa_t)_text_end; pa += 4096)
-    #     init_map(pa, pa, PTE_R | PTE_W | PTE_X);
+    # kmap(0x80000000, (pa_t)_text_end - 0x80000000, PTE_R | PTE_W | PTE_X);
     
-    # // kernel data
-    # for (pa_t pa = (pa_t)_text_end; pa < (pa_t)_ram_end; pa += 4096)
-    #     init_map(pa, pa, PTE_R | PTE_W);
+    # // kernel data and the rest of RAM
+    # kmap((pa_t)_text_end, (pa_t)_ram_end - (pa_t)_text_end, PTE_R | PTE_W);
+
+# leaf page size by page table level (root first)
+LVLSIZE = [1 << 30, 1 << 21, 1 << 12]
+
+def vpns(va):
+    return [(va >> 30) & 0x1ff, (va >> 21) & 0x1ff, (va >> 12) & 0x1ff]
+
+# Walk kernelpt the way the mmu does
+# Returns the list of visited tables, the leaf level and the pa
+# or raises if va is unmapped or the walk is malformed
+def walk(va):
+    pt = "kernelpt"
+    tables = []
+    for level, vpn in enumerate(vpns(va)):
+        pte = gdb.parse_and_eval(f"({pt})->arr[{vpn}]")
+        if not int(pte['valid']):
+            raise Exception(f"{hex(va)}: invalid pte at level {level}")
+        ppn = int(pte['ppn']) << 12
+        if int(pte['readable']) or int(pte['writable']) or int(pte['executable']):
+            size = LVLSIZE[level]
+            if ppn & (size - 1):
+                raise Exception(f"{hex(va)}: misaligned superpage {hex(ppn)} at level {level}")
+            return tables, level, ppn + (va & (size - 1))
+        tables.append(ppn)
+        pt = f"(pt_t *){ppn}"
+    raise Exception(f"{hex(va)}: no leaf pte")
+
+# Leaf level kmap (map) should have picked for va in [start, end):
+# the largest page whose aligned block around va lies within the range
+def expected_level(va, start, end):
+    for level, size in enumerate(LVLSIZE):
+        base = va & ~(size - 1)
+        if base >= start and base + size <= end:
+            return level
+    return 2
 
 class TestVM (gdb.Command):
 
@@ -30,7 +59,7 @@ class TestVM (gdb.Command):
         self.errlis = []
     
     def prterr(self):
-        print(f"\n{5 - len(self.errlis)}/{5} correct")
+        print(f"\n{self.total - len(self.errlis)}/{self.total} correct")
         for err in self.errlis:
             print(err)
     
@@ -50,7 +79,26 @@ class TestVM (gdb.Command):
                 print("Too many errors")
                 self.prterr()
 
+    # Walk a few addresses in the range and check they are
+    # identity mapped with the largest page the kernel could use
+    def testwalk(self, name, start, end):
+        print(f"test {name} walk")
+        vas = {start, end - 1, (start + end) // 2 & ~0xfff}
+        for va in sorted(vas):
+            self.total = self.total + 1
+            try:
+                _, level, pa = walk(va)
+                if pa != va:
+                    raise Exception(f"{hex(va)} maps to {hex(pa)}")
+                if level != expected_level(va, start, end):
+                    raise Exception(f"{hex(va)} mapped with {LVLSIZE[level] >> 10}K page, "
+                                    f"expected {LVLSIZE[expected_level(va, start, end)] >> 10}K")
+            except Exception as msg:
+                self.errlis.append(msg)
+
     def invoke(self, arg, from_tty):
+        self.errlis = []
+        self.total = 6
         _text_end = self.eval("_text_end")
         _bss_end = self.eval("_bss_end")
         _ram_end = self.eval("_ram_end")
@@ -60,6 +108,10 @@ class TestVM (gdb.Command):
         self.testrange("ktext", 0x80000000, _text_end)
         self.testrange("kdata", _text_end, _bss_end)
         self.testrange("dram", _bss_end, _ram_end)
+        self.testwalk("plic", 0xC000000, 0xC400000)
+        self.testwalk("uart", 0x10000000, 0x10001000)
+        self.testwalk("ktext", 0x80000000, _text_end)
+        self.testwalk("kdata+dram", _text_end, _ram_end)
         self.prterr()
 
 
@@ -71,37 +123,16 @@ class TestAT(gdb.Command):
     def get_addr(self, name):
         return int(gdb.parse_and_eval(name).__str__().split(' ')[0], 16)
     
-    def getstr(self, name):
-        return gdb.parse_and_eval(name).__str__()
-    
-    def extract_ppn(self, str):
-        return int(str.split(',')[9].split(' ')[3]) << 12
-
-    def vpn1(self, va):
-        return (va & 0b111111111000000000000) >> 12
-    
-    def vpn2(self,va):
-        return (va & 0b111111111000000000000000000000) >> (12 + 9)
-    
-    def vpn3(self, va):
-        return (va & 0b111111111000000000000000000000000000000) >> (12 + 9 * 2)
-    
     def invoke(self, va, from_tty):
 
         va = int(va, 16)
 
-        pte1 = self.getstr(f"kernelpt->arr[{self.vpn3(va)}]")
-        pt2 = self.extract_ppn(pte1)
-
-        pte2 = self.getstr(f"((pt_t *){pt2})->arr[{self.vpn2(va)}]")
-        pt3 = self.extract_ppn(pte2)
-
-        pte3 = self.getstr(f"((pt_t *){pt3})->arr[{self.vpn1(va)}]")
-        pa = self.extract_ppn(pte3)
+        tables, level, pa = walk(va)
 
         print("recursive lookup:")
-        print("pt2 =", hex(pt2));
-        print("pt3 =", hex(pt3));
+        for i, pt in enumerate(tables):
+            print(f"pt{i + 2} =", hex(pt))
+        print(f"leaf at level {level + 1} ({LVLSIZE[level] >> 10}K page)")
         print("pa =", hex(pa))
 
         
@@ -3,6 +3,8 @@
 #include "../include/plic.h"
 #include "../include/uart.h"
 #include "../include/disk.h"
+#include "../include/vm.h"
+#include "../include/kpanic.h"
 
 char* icause[] = {
     "User software interrupt",
@@ -50,6 +52,13 @@ void _strap_hdlr() {
         else kprintf("%s\n", icause[no]);
         plic.eoi(irq);
     }
+    else if (no == 12 || no == 13 || no == 15) {
+        // returning restarts the faulting instruction
+        if (vmmngr.fault(r_stval(), no))
+            return;
+        kprintf("%s at %p (sepc %p)\n", ecause[no], r_stval(), r_sepc());
+        kpanic("unhandled page fault\n");
+    }
     else
         kprintf("%s\n", ecause[no]);
 }   